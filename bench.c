@@ -0,0 +1,410 @@
+/*
+ * Benchmarks for kilo, run by 'make bench'. Like test_kilo.c this
+ * compiles kilo.c in whole and calls the editor's functions directly, in
+ * a child process per section, with output going to a pseudo-terminal
+ * that is read and counted. Files are generated under /tmp from kilo.c
+ * itself. 'bench name...' runs only the named sections.
+ */
+
+#define main kilo_main
+#include "kilo.c"
+#undef main
+
+#include <pty.h>
+#include <sys/wait.h>
+
+#define BENCH_MB (1024 * 1024)
+
+size_t bench_size = 256 * BENCH_MB;
+volatile size_t bench_out;
+int bench_master;
+
+double benchNow() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void *benchDrain(void *arg) {
+  char buf[1 << 16];
+  int fd = *(int *)arg;
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) bench_out += n;
+  return NULL;
+}
+
+/* Puts stdin and stdout on a fresh 50x160 pseudo-terminal and initializes
+ * the editor on it. */
+void benchTerminal() {
+  int slave;
+  struct winsize ws = {50, 160, 0, 0};
+  pthread_t tid;
+  if (openpty(&bench_master, &slave, NULL, NULL, &ws) == -1) die("openpty");
+  struct termios raw;
+  tcgetattr(slave, &raw);
+  cfmakeraw(&raw);
+  tcsetattr(slave, TCSANOW, &raw);
+  dup2(slave, STDIN_FILENO);
+  dup2(slave, STDOUT_FILENO);
+  pthread_create(&tid, NULL, benchDrain, &bench_master);
+  initEditor();
+}
+
+/* Returns the path of a file of about 'size' bytes of C, made of copies
+ * of kilo.c, writing it first if it is not there yet. */
+char *benchCorpus(size_t size) {
+  static char path[64];
+  snprintf(path, sizeof(path), "/tmp/kilo_bench_%zu.c", size);
+  struct stat st;
+  if (stat(path, &st) == 0 && (size_t)st.st_size >= size) return path;
+
+  FILE *in = fopen("kilo.c", "r");
+  if (!in) die("kilo.c");
+  char *src = malloc(1 << 20);
+  size_t len = fread(src, 1, 1 << 20, in);
+  fclose(in);
+  FILE *out = fopen(path, "w");
+  if (!out) die("fopen");
+  for (size_t n = 0; n < size; n += len) fwrite(src, 1, len, out);
+  fclose(out);
+  free(src);
+  return path;
+}
+
+char *benchRead(const char *path, size_t *len) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) die(path);
+  char *buf = malloc(st.st_size);
+  size_t got = 0;
+  ssize_t n;
+  while (got < (size_t)st.st_size &&
+         (n = read(fd, buf + got, st.st_size - got)) > 0)
+    got += n;
+  close(fd);
+  *len = got;
+  return buf;
+}
+
+void benchReport(const char *what, double value, const char *unit) {
+  fprintf(stderr, "  %-36s %10.2f %s\n", what, value, unit);
+}
+
+/* Repaints the whole screen on the next refresh. */
+void benchInvalidate() {
+  for (int y = 0; y < E.shadow.nlines; y++) E.shadow.lines[y].len = -1;
+}
+
+/*** sections ***/
+
+typedef void scanfn(const char *, size_t, size_t, struct lineindex *);
+
+void benchScan(const char *name, scanfn *fn, const char *s, size_t len) {
+  struct lineindex li = {NULL, 0, 0};
+  lineIndexGrow(&li, len / 32);
+  double t = benchNow();
+  fn(s, 0, len, &li);
+  t = benchNow() - t;
+  benchReport(name, len / t / BENCH_MB, "MB/s");
+  free(li.off);
+}
+
+void benchIndex() {
+  size_t len;
+  char *s = benchRead(benchCorpus(bench_size), &len);
+  benchScan("scan, memchr", lineScanScalar, s, len);
+#if defined(__x86_64__)
+  benchScan("scan, SSE2", lineScanSSE2, s, len);
+  if (__builtin_cpu_supports("avx2"))
+    benchScan("scan, AVX2", lineScanAVX2, s, len);
+#endif
+  free(s);
+}
+
+void benchLoad() {
+  double t = benchNow();
+  editorOpen(benchCorpus(bench_size));
+  editorRefreshScreen();
+  benchReport("open to first frame", (benchNow() - t) * 1e3, "ms");
+  editorLoadPoll(1);
+  t = benchNow() - t;
+  benchReport("open to fully indexed", t * 1e3, "ms");
+  benchReport("index throughput", E.origlen / t / BENCH_MB, "MB/s");
+}
+
+void benchScroll() {
+  editorOpen(benchCorpus(16 * BENCH_MB));
+  editorLoadPoll(1);
+  editorRefreshScreen();
+  int frames = 2000;
+  double t = benchNow();
+  for (int i = 0; i < frames; i++) {
+    editorProcessKeypress(PAGE_DOWN);
+    editorRefreshScreen();
+  }
+  benchReport("page down, per frame", (benchNow() - t) / frames * 1e6, "us");
+  t = benchNow();
+  for (int i = 0; i < frames; i++) {
+    editorProcessKeypress(CTRL_ARROW_DOWN);
+    editorRefreshScreen();
+  }
+  benchReport("scroll one line, per frame",
+              (benchNow() - t) / frames * 1e6, "us");
+}
+
+void benchRedraw() {
+  editorOpen(benchCorpus(16 * BENCH_MB));
+  editorLoadPoll(1);
+  E.cy = E.rowoff = 100000;
+  editorRefreshScreen();
+  int frames = 5000;
+  size_t out = bench_out;
+  double t = benchNow();
+  for (int i = 0; i < frames; i++) {
+    benchInvalidate();
+    editorRefreshScreen();
+  }
+  benchReport("full repaint, per frame", (benchNow() - t) / frames * 1e6,
+              "us");
+  benchReport("full repaint, output", (double)(bench_out - out) / frames,
+              "bytes");
+  t = benchNow();
+  for (int i = 0; i < frames; i++) editorRefreshScreen();
+  benchReport("unchanged frame", (benchNow() - t) / frames * 1e6, "us");
+
+  /* A screen four times the size in each direction, so the frame no
+   * longer fits the buffers of the one before. */
+  E.screenrows = 200;
+  E.screencols = 640;
+  t = benchNow();
+  for (int i = 0; i < frames / 10; i++) {
+    benchInvalidate();
+    editorRefreshScreen();
+  }
+  benchReport("full repaint 200x640, per frame",
+              (benchNow() - t) / (frames / 10) * 1e6, "us");
+
+  /* The same rows without highlighting: one run of colour per row. */
+  E.screenrows = 50;
+  E.screencols = 160;
+  E.syntax = NULL;
+  t = benchNow();
+  for (int i = 0; i < frames; i++) {
+    benchInvalidate();
+    editorRefreshScreen();
+  }
+  benchReport("full repaint, plain, per frame",
+              (benchNow() - t) / frames * 1e6, "us");
+}
+
+void benchKeys() {
+  editorOpen(benchCorpus(16 * BENCH_MB));
+  editorLoadPoll(1);
+  E.cy = E.rowoff = 100000;
+  editorRefreshScreen();
+  int keys = 20000;
+  double t = benchNow();
+  for (int i = 0; i < keys; i++) {
+    editorProcessKeypress('a' + i % 26);
+    editorRefreshScreen();
+  }
+  benchReport("type and draw, per key", (benchNow() - t) / keys * 1e6, "us");
+  t = benchNow();
+  for (int i = 0; i < keys; i++) {
+    editorProcessKeypress(BACKSPACE);
+    editorRefreshScreen();
+  }
+  benchReport("delete and draw, per key", (benchNow() - t) / keys * 1e6,
+              "us");
+  t = benchNow();
+  for (int i = 0; i < keys; i++) {
+    editorProcessKeypress(i % 80 == 79 ? '\r' : 'a' + i % 26);
+    editorRefreshScreen();
+  }
+  benchReport("type lines and draw, per key",
+              (benchNow() - t) / keys * 1e6, "us");
+}
+
+/* Lexes every row of a 32 MB C file straight through editorHighlightFrom,
+ * with renders built beforehand and without the cache or the worker. */
+void benchHighlight() {
+  editorOpen(benchCorpus(32 * BENCH_MB));
+  editorLoadPoll(1);
+  for (int i = 0; i < E.numrows; i++) editorUpdateRow(editorRowAt(i));
+  size_t bytes = 0;
+  int in = 0;
+  double t = benchNow();
+  for (erow *row = editorRowAt(0); row; row = rowNext(row)) {
+    memset(row->hl, HL_NORMAL, row->rsize);
+    in = editorHighlightFrom(row, 0, in, -1);
+    bytes += row->rsize;
+  }
+  t = benchNow() - t;
+  benchReport("lex C", bytes / t / BENCH_MB, "MB/s");
+}
+
+/* Draws the first frame of a C file that is one 1 MB line of 'a,b;',
+ * a separator every other byte and no space or parenthesis to stop a
+ * lookahead. */
+void benchLongLine() {
+  char path[] = "/tmp/kilo_bench_longline.c";
+  FILE *fp = fopen(path, "w");
+  if (!fp) die("fopen");
+  for (int i = 0; i < BENCH_MB / 4; i++) fputs("a,b;", fp);
+  fputc('\n', fp);
+  fclose(fp);
+
+  double t = benchNow();
+  editorOpen(path);
+  editorRefreshScreen();
+  benchReport("first frame, 1 MB line", (benchNow() - t) * 1e3, "ms");
+  t = benchNow();
+  for (int i = 0; i < 100; i++) {
+    editorProcessKeypress(i % 2 ? BACKSPACE : 'x');
+    editorRefreshScreen();
+  }
+  benchReport("edit start of 1 MB line, per key",
+              (benchNow() - t) / 100 * 1e3, "ms");
+  unlink(path);
+}
+
+struct benchtyped {
+  const char *s;
+  size_t len;
+};
+
+void *benchTypist(void *arg) {
+  struct benchtyped *in = arg;
+  size_t done = 0;
+  ssize_t n;
+  while (done < in->len &&
+         (n = write(bench_master, in->s + done, in->len - done)) > 0)
+    done += n;
+  return NULL;
+}
+
+/* Pastes 1 MB of C through the terminal, as a terminal with bracketed
+ * paste sends it, and draws the frame after it. */
+void benchPaste() {
+  size_t len;
+  char *text = benchRead(benchCorpus(BENCH_MB), &len);
+  struct benchtyped in;
+  char *buf = malloc(BENCH_MB + 12);
+  memcpy(buf, "\x1b[200~", 6);
+  memcpy(buf + 6, text, BENCH_MB);
+  memcpy(buf + 6 + BENCH_MB, "\x1b[201~", 6);
+  in.s = buf;
+  in.len = BENCH_MB + 12;
+
+  editorOpen(benchCorpus(BENCH_MB));
+  editorRefreshScreen();
+  pthread_t tid;
+  double t = benchNow();
+  pthread_create(&tid, NULL, benchTypist, &in);
+  editorProcessKeypress(editorReadKey());
+  editorRefreshScreen();
+  benchReport("1 MB bracketed paste", (benchNow() - t) * 1e3, "ms");
+  pthread_join(tid, NULL);
+}
+
+/* Runs fn in a child with KILO_THREADS set to n. */
+void benchWithThreads(int n, void (*fn)(int)) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%d", n);
+    setenv("KILO_THREADS", buf, 1);
+    fn(n);
+    _exit(0);
+  }
+  waitpid(pid, NULL, 0);
+}
+
+void benchIndexThreads(int n) {
+  char *path = benchCorpus(1024 * BENCH_MB);
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) die(path);
+  char *s = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (s == MAP_FAILED) die("mmap");
+  struct lineindex li = {NULL, 0, 0};
+  editorIndexLines(s, 0, st.st_size, &li);
+  free(li.off);
+  li.off = NULL;
+  li.n = li.cap = 0;
+  double t = benchNow();
+  editorIndexLines(s, 0, st.st_size, &li);
+  t = benchNow() - t;
+  char what[64];
+  snprintf(what, sizeof(what), "index 1 GB, %d thread%s", n, n > 1 ? "s" : "");
+  benchReport(what, st.st_size / t / BENCH_MB, "MB/s");
+}
+
+void benchWorkerThreads(int n) {
+  editorOpen(benchCorpus(64 * BENCH_MB));
+  editorLoadPoll(1);
+  for (int i = 0; i < E.numrows; i++) editorRowAt(i);
+  double t = benchNow();
+  editorSelectSyntaxHighlight();
+  while (E.nhlstale || E.hlw.active) {
+    editorHighlightPoll(0);
+    editorHighlightPoll(1);
+  }
+  t = benchNow() - t;
+  char what[64];
+  snprintf(what, sizeof(what), "worker pass 64 MB, %d thread%s", n,
+           n > 1 ? "s" : "");
+  benchReport(what, 64 / t, "MB/s");
+}
+
+/* The line index and a full highlight pass, with one thread and with as
+ * many as KILO_THREADS asks for, or four when it is unset. */
+void benchThreads() {
+  char *env = getenv("KILO_THREADS");
+  int n = env ? atoi(env) : 4;
+  benchWithThreads(1, benchIndexThreads);
+  if (n > 1) benchWithThreads(n, benchIndexThreads);
+  benchWithThreads(1, benchWorkerThreads);
+  if (n > 1) benchWithThreads(n, benchWorkerThreads);
+}
+
+struct section {
+  const char *name;
+  void (*fn)();
+};
+
+struct section sections[] = {
+  {"index", benchIndex},
+  {"load", benchLoad},
+  {"scroll", benchScroll},
+  {"redraw", benchRedraw},
+  {"keys", benchKeys},
+  {"highlight", benchHighlight},
+  {"longline", benchLongLine},
+  {"threads", benchThreads},
+  {"paste", benchPaste},
+};
+
+int main(int argc, char *argv[]) {
+  char *env = getenv("BENCH_MB");
+  if (env) bench_size = atol(env) * BENCH_MB;
+  for (size_t i = 0; i < sizeof(sections) / sizeof(sections[0]); i++) {
+    int run = argc < 2;
+    for (int a = 1; a < argc; a++)
+      if (!strcmp(argv[a], sections[i].name)) run = 1;
+    if (!run) continue;
+
+    fprintf(stderr, "%s\n", sections[i].name);
+    pid_t pid = fork();
+    if (pid == 0) {
+      benchTerminal();
+      sections[i].fn();
+      _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      fprintf(stderr, "  failed\n");
+  }
+  return 0;
+}
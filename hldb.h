@@ -0,0 +1,119 @@
+/*** syntax database ***/
+
+/*
+ * The filetypes kilo knows about. This file is shared by kilo.c and by
+ * hlgen.c, which make runs to compile every HLDB entry into the lexer
+ * tables of hltables.h: a byte class table, a transition table over
+ * (state, class) and a perfect hash of the keywords.
+ */
+
+#ifndef KILO_HLDB_H
+#define KILO_HLDB_H
+
+#define HL_HIGHLIGHT_NUMBERS      (1<<0)
+#define HL_HIGHLIGHT_STRINGS      (1<<1)
+#define HL_HIGHLIGHT_FUNCTIONS    (2<<1)
+
+struct editorSyntax {
+  char* filetype;
+  char** filematch;
+  char** keywords;
+  char* single_line_comment_start;
+  char* multi_line_comment_start;
+  char* multi_line_comment_end;
+  int flags;
+};
+
+char *C_HL_extensions[] = {".c", ".h", ".cpp", NULL};
+char *C_HL_keywords[] = {
+  "switch", "if", "while", "for", "break", "continue", "return", "else",
+  "struct", "union", "typedef", "static", "enum", "class", "case", "include", "define",
+
+  "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+  "void|", NULL
+};
+
+struct editorSyntax HLDB[] =
+{
+  {
+    "C",
+    C_HL_extensions,
+    C_HL_keywords,
+    "//", "/*", "*/",
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_FUNCTIONS
+  },
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
+/* Lexer states. The first three are outside strings and comments and
+ * remember whether the last byte was a separator or part of a number. */
+enum hlState {
+  HLS_SEP = 0,
+  HLS_WORD,
+  HLS_NUMBER,
+  HLS_DQUOTE,
+  HLS_SQUOTE,
+  HLS_COMMENT,
+  HLS_STATES
+};
+
+/* Byte classes. HLC_DELIM marks the first byte of a comment delimiter,
+ * which is matched in full before the byte's plain class is used. */
+enum hlClass {
+  HLC_WORD = 0,
+  HLC_SEP,
+  HLC_DIGIT,
+  HLC_DOT,
+  HLC_DQUOTE,
+  HLC_SQUOTE,
+  HLC_ESCAPE,
+  HLC_DELIM,
+  HLC_CLASSES
+};
+
+enum hlAction {
+  HLA_PAINT = 0,   /* paint the byte 'hl' and go to 'next' */
+  HLA_TOKEN,       /* a token starts here: try keywords and calls first */
+  HLA_ESCAPE,      /* paint this byte and the next one */
+  HLA_DELIM        /* try the comment delimiters first */
+};
+
+struct hlmove {
+  unsigned char action;
+  unsigned char hl;
+  unsigned char next;
+};
+
+/* Keywords in a perfect hash: each slot holds at most one keyword, so a
+ * token is classified with one hash and one compare. */
+struct kwentry {
+  const char *s;
+  int len;
+  unsigned char hl;
+};
+
+struct kwtable {
+  const struct kwentry *slot;
+  unsigned int mask;
+  unsigned int seed;
+  int maxlen;
+};
+
+struct hltable {
+  unsigned char cls[256];
+  unsigned char plain[256];
+  struct hlmove move[HLS_STATES][HLC_CLASSES];
+  int scs_len;
+  int mcs_len;
+  int mce_len;
+  struct kwtable keywords;
+};
+
+static inline unsigned int kwHash(const char *s, int len, unsigned int seed) {
+  unsigned int h = seed;
+  for (int k = 0; k < len; k++) h = (h ^ (unsigned char)s[k]) * 16777619u;
+  return h;
+}
+
+#endif
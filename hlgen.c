@@ -0,0 +1,223 @@
+/*
+ * hlgen compiles the syntax database of hldb.h into the lexer tables kilo
+ * highlights with, and writes them to stdout as hltables.h. Every HLDB
+ * entry becomes a byte class table, a move for each (state, class) pair
+ * with the entry's flags already applied, and a perfect hash of its
+ * keywords, so highlighting costs the same per byte for any filetype.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hldb.h"
+
+struct gmove {
+  const char *action;
+  const char *hl;
+  const char *next;
+};
+
+static const char *stateNames[HLS_STATES] = {
+  "HLS_SEP", "HLS_WORD", "HLS_NUMBER", "HLS_DQUOTE", "HLS_SQUOTE",
+  "HLS_COMMENT"
+};
+
+int is_separator(int c) {
+  if (c >= 128) return 0;
+  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];#", c) != NULL;
+}
+
+int plainClass(int c) {
+  if (c == '"') return HLC_DQUOTE;
+  if (c == '\'') return HLC_SQUOTE;
+  if (c == '\\') return HLC_ESCAPE;
+  if (c >= '0' && c <= '9') return HLC_DIGIT;
+  if (c == '.') return HLC_DOT;
+  return is_separator(c) ? HLC_SEP : HLC_WORD;
+}
+
+struct gmove paint(const char *hl, int next) {
+  struct gmove m = {"HLA_PAINT", hl, stateNames[next]};
+  return m;
+}
+
+/* The move outside strings and comments, where 'state' tells whether the
+ * previous byte was a separator or part of a number. */
+struct gmove plainMove(int state, int cls, int flags) {
+  int prev_sep = state == HLS_SEP;
+  int prev_num = state == HLS_NUMBER;
+
+  if (cls == HLC_DQUOTE || cls == HLC_SQUOTE) {
+    if (flags & HL_HIGHLIGHT_STRINGS)
+      return paint("HL_STRING", cls == HLC_DQUOTE ? HLS_DQUOTE : HLS_SQUOTE);
+    cls = HLC_WORD;
+  }
+  if (cls == HLC_DIGIT) {
+    if ((flags & HL_HIGHLIGHT_NUMBERS) && (prev_sep || prev_num))
+      return paint("HL_NUMBER", HLS_NUMBER);
+    cls = HLC_WORD;
+  }
+  if (cls == HLC_DOT) {
+    if ((flags & HL_HIGHLIGHT_NUMBERS) && prev_num)
+      return paint("HL_NUMBER", HLS_NUMBER);
+    cls = HLC_SEP;
+  }
+  if (cls == HLC_ESCAPE) cls = HLC_WORD;
+
+  if (cls == HLC_SEP) return paint("HL_NORMAL", HLS_SEP);
+  struct gmove m = paint("HL_NORMAL", HLS_WORD);
+  if (prev_sep) m.action = "HLA_TOKEN";
+  return m;
+}
+
+struct gmove move(int state, int cls, int flags) {
+  struct gmove delim = {"HLA_DELIM", "HL_NORMAL", stateNames[state]};
+  switch (state) {
+    case HLS_DQUOTE:
+    case HLS_SQUOTE:
+      if (cls == HLC_ESCAPE) {
+        struct gmove m = {"HLA_ESCAPE", "HL_STRING", stateNames[state]};
+        return m;
+      }
+      if ((state == HLS_DQUOTE && cls == HLC_DQUOTE) ||
+          (state == HLS_SQUOTE && cls == HLC_SQUOTE))
+        return paint("HL_STRING", HLS_SEP);
+      return paint("HL_STRING", state);
+    case HLS_COMMENT:
+      return cls == HLC_DELIM ? delim : paint("HL_MLCOMMENT", HLS_COMMENT);
+    default:
+      return cls == HLC_DELIM ? delim : plainMove(state, cls, flags);
+  }
+}
+
+void printString(const char *s, int len) {
+  putchar('"');
+  for (int k = 0; k < len; k++) {
+    if (s[k] == '"' || s[k] == '\\') putchar('\\');
+    putchar(s[k]);
+  }
+  putchar('"');
+}
+
+/* Picks a table size and hash seed under which no two keywords collide and
+ * prints the slots. A trailing '|' marks a KEYWORD2. */
+void printKeywords(int i, struct kwtable *kw) {
+  char **words = HLDB[i].keywords;
+  int n = 0;
+  while (words && words[n]) n++;
+  memset(kw, 0, sizeof(*kw));
+  if (n == 0) return;
+
+  int *len = malloc(sizeof(int) * n);
+  for (int k = 0; k < n; k++) {
+    len[k] = strlen(words[k]);
+    if (len[k] > 0 && words[k][len[k]-1] == '|') len[k]--;
+    if (len[k] > kw->maxlen) kw->maxlen = len[k];
+  }
+
+  unsigned int size = 16;
+  while (size < (unsigned int)n * 2) size *= 2;
+  int *slot = NULL;
+  for (;;) {
+    slot = realloc(slot, sizeof(int) * size);
+    kw->mask = size - 1;
+    for (kw->seed = 2166136261u; kw->seed < 2166136261u + 256; kw->seed++) {
+      int k;
+      for (unsigned int j = 0; j < size; j++) slot[j] = -1;
+      for (k = 0; k < n; k++) {
+        int *e = &slot[kwHash(words[k], len[k], kw->seed) & kw->mask];
+        /* Later duplicates of a keyword lose, as in a linear scan. */
+        if (*e != -1 && (len[*e] != len[k] ||
+                         memcmp(words[*e], words[k], len[k])))
+          break;
+        if (*e == -1) *e = k;
+      }
+      if (k == n) break;
+    }
+    if (kw->seed < 2166136261u + 256) break;
+    size *= 2;
+  }
+
+  printf("static const struct kwentry HLKW_%d[%u] = {\n", i, size);
+  for (unsigned int j = 0; j < size; j++) {
+    int k = slot[j];
+    if (k == -1) {
+      printf("  {NULL, 0, 0},\n");
+      continue;
+    }
+    printf("  {");
+    printString(words[k], len[k]);
+    printf(", %d, %s},\n", len[k],
+      words[k][len[k]] == '|' ? "HL_KEYWORD2" : "HL_KEYWORD1");
+  }
+  printf("};\n\n");
+  free(slot);
+  free(len);
+}
+
+void printClasses(const unsigned char *cls) {
+  printf("    {\n");
+  for (int c = 0; c < 256; c++)
+    printf("%s%d,%s", c % 16 ? " " : "      ", cls[c], c % 16 == 15 ? "\n" : "");
+  printf("    },\n");
+}
+
+int main() {
+  struct kwtable kw[HLDB_ENTRIES];
+
+  printf("/* Generated from hldb.h by hlgen. Do not edit. */\n\n");
+  for (unsigned int i = 0; i < HLDB_ENTRIES; i++) printKeywords(i, &kw[i]);
+
+  printf("static const struct hltable HLTABLES[HLDB_ENTRIES] = {\n");
+  for (unsigned int i = 0; i < HLDB_ENTRIES; i++) {
+    struct editorSyntax *syn = &HLDB[i];
+    const char *scs = syn->single_line_comment_start;
+    const char *mcs = syn->multi_line_comment_start;
+    const char *mce = syn->multi_line_comment_end;
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs && mce ? strlen(mcs) : 0;
+    int mce_len = mcs && mce ? strlen(mce) : 0;
+    if (!mcs_len || !mce_len) mcs_len = mce_len = 0;
+
+    unsigned char plain[256], cls[256];
+    for (int c = 0; c < 256; c++) plain[c] = cls[c] = plainClass(c);
+    const char *delims[3] = {
+      scs_len ? scs : NULL, mcs_len ? mcs : NULL, mce_len ? mce : NULL
+    };
+    for (int d = 0; d < 3; d++) {
+      if (!delims[d]) continue;
+      int c = (unsigned char)delims[d][0];
+      if (plain[c] != HLC_WORD && plain[c] != HLC_SEP) {
+        fprintf(stderr, "hlgen: %s: comment delimiter \"%s\" cannot start "
+          "with a quote, digit, '.' or '\\'\n", syn->filetype, delims[d]);
+        return 1;
+      }
+      cls[c] = HLC_DELIM;
+    }
+
+    printf("  { /* %s */\n", syn->filetype);
+    printClasses(cls);
+    printClasses(plain);
+    printf("    {\n");
+    for (int s = 0; s < HLS_STATES; s++) {
+      printf("      { /* %s */\n", stateNames[s]);
+      for (int c = 0; c < HLC_CLASSES; c++) {
+        struct gmove m = move(s, c, syn->flags);
+        printf("        {%s, %s, %s},\n", m.action, m.hl, m.next);
+      }
+      printf("      },\n");
+    }
+    printf("    },\n");
+    printf("    %d, %d, %d,\n", scs_len, mcs_len, mce_len);
+    if (kw[i].maxlen)
+      printf("    {HLKW_%u, %uu, %uu, %d},\n", i, kw[i].mask, kw[i].seed,
+        kw[i].maxlen);
+    else
+      printf("    {NULL, 0, 0, 0},\n");
+    printf("  },\n");
+  }
+  printf("};\n");
+  return 0;
+}
@@ -9,14 +9,25 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
 #include <termios.h>
 #include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "hldb.h"
 
 /*** defines ***/
 
@@ -24,13 +35,23 @@
 #define KILO_TAB_STOP 4
 #define KILO_QUIT_TIMES 3
 #define KILO_LINE_NUM_SEP ": "
+#define KILO_ADD_CHUNK (64 * 1024)
+#define KILO_GAP_MIN 1024
+#define KILO_INDEX_CHUNK_MIN (1 << 20)
+#define KILO_LOAD_BLOCK (16 << 20)
+#define KILO_SAVE_IOV 1024
+#define KILO_JOURNAL_MS 200
+#define KILO_HL_BATCH 65536
+#define KILO_HL_CHUNK_MIN 4096
+#define KILO_HLCACHE_SLOTS 4096
+#define KILO_HLCACHE_MAXLEN 1024
+#define KILO_FPS 60
+#define KILO_INBUF (64 * 1024)
+#define KILO_ESC_MS 50
+#define KILO_PASTE_MS 500
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
-#define HL_HIGHLIGHT_NUMBERS      (1<<0)
-#define HL_HIGHLIGHT_STRINGS      (1<<1)
-#define HL_HIGHLIGHT_FUNCTIONS    (2<<1)
-
 enum editorKey {
   CTRL_ENTER = 30,
   CTRL_BACKSPACE,
@@ -54,7 +75,19 @@ enum editorKey {
   CTRL_SHIFT_ARROW_RIGHT,
   CTRL_SHIFT_ARROW_UP,
   CTRL_SHIFT_ARROW_DOWN,
-  CTRL_DELETE
+  CTRL_DELETE,
+  PASTE
+};
+
+enum journalOp {
+  J_INSERT_ROW = 1,
+  J_DELETE_ROW,
+  J_INSERT_CHAR,
+  J_DELETE_CHAR,
+  J_APPEND_ROW,
+  J_TRUNCATE,
+  J_MOVE_UP,
+  J_MOVE_DOWN
 };
 
 enum editorHighlight {
@@ -71,26 +104,185 @@ enum editorHighlight {
 
 /*** data ***/
 
-struct editorSyntax {
-  char* filetype;
-  char** filematch;
-  char** keywords;
-  char* single_line_comment_start;
-  char* multi_line_comment_start;
-  char* multi_line_comment_end;
-  int flags;
-};
+typedef struct epiece {
+  const char *s;
+  int len;
+} epiece;
+
+typedef struct egap {
+  char *buf;
+  int start;
+  int end;
+  int cap;
+  int tabs;
+} egap;
 
 typedef struct erow {
-  int idx;
+  struct erow *left;
+  struct erow *right;
+  struct erow *parent;
+  int count;
+  unsigned int prio;
+  int run;
+  int runfrom;
   int size;
+  int npieces;
+  int piececap;
+  epiece *pieces;
+  epiece piece;
+  egap *gap;
   int rsize;
-  char *chars;
   char *render;
   unsigned char *hl;
   int hl_open_comment;
+  unsigned int hlgen;
+  int flags;
 } erow;
 
+#define ROW_RENDER_OWNED (1<<0)
+#define ROW_STALE (1<<1)
+#define ROW_HL_STALE (1<<2)
+#define ROW_HL_NONE (1<<3)
+
+struct addbuf {
+  char *chunk;
+  int len;
+  int cap;
+};
+
+struct pastebuf {
+  char *buf;
+  int len;
+  int cap;
+};
+
+struct inbuf {
+  unsigned char buf[KILO_INBUF];
+  unsigned int head;
+  unsigned int tail;
+};
+
+struct lineindex {
+  size_t *off;
+  size_t n;
+  size_t cap;
+};
+
+struct journal {
+  int fd;
+  char *path;
+  char *buf;
+  size_t len;
+  size_t cap;
+  off_t size;
+  struct timespec since;
+  int replaying;
+  int failing;
+  int unsynced;
+  int syncing;
+  pthread_t syncer;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+};
+
+struct saveitem {
+  const char *s;
+  int len;
+  int from;
+  int eol;
+};
+
+struct saver {
+  pthread_t tid;
+  pthread_mutex_t lock;
+  int active;
+  int done;
+  struct saveitem *items;
+  int nitems;
+  char *filename;
+  int dirty;
+  off_t journal_at;
+  size_t written;
+  double secs;
+  int err;
+};
+
+/* One row of a highlight job. 'render' is the row's render, or for a
+ * ROW_STALE row its single piece, which the worker renders itself. */
+struct hlitem {
+  erow *row;
+  const char *render;
+  int rsize;
+  int copied;
+  int stale;
+  int needs;
+  int old_open;
+  unsigned int gen;
+  char *out_render;
+  int out_rsize;
+  unsigned char *hl;
+  int open;
+};
+
+struct highlighter {
+  pthread_t tid;
+  pthread_mutex_t lock;
+  int active;
+  int done;
+  struct hlitem *items;
+  int nitems;
+  int ndone;
+  int in_comment;
+  int parallel;
+  unsigned int rowsgen;
+};
+
+/* A cached row: its render followed by the hl it was given when entered
+ * in state 'in' under syntax 'syntax' (the HLDB index plus one, so that an
+ * empty slot has 0). */
+struct hlcentry {
+  uint64_t hash;
+  char *render;
+  int rsize;
+  int syntax;
+  unsigned char in;
+  unsigned char out;
+};
+
+struct hlcache {
+  pthread_mutex_t lock;
+  struct hlcentry *slot;
+  unsigned long hits;
+  unsigned long misses;
+};
+
+/* The bytes last sent for each terminal line, and where the cursor was
+ * left, so that a frame only sends what changed. */
+struct screenline {
+  char *b;
+  int len;
+  int cap;
+};
+
+struct shadow {
+  struct screenline *lines;
+  int nlines;
+  int cx, cy;
+  int rowoff;
+  int plain;
+  struct timespec drawn;
+};
+
+struct loader {
+  pthread_t tid;
+  pthread_mutex_t lock;
+  struct lineindex pending;
+  size_t scanned;
+  int done;
+  int active;
+  size_t seen;
+};
+
 struct editorConfig {
   int cx, cy;
   int rx;
@@ -100,12 +292,33 @@ struct editorConfig {
   int screencols;
   int numrows;
   int rowborder_width;
-  erow *row;
+  erow *rows;
+  erow *hot;
+  char *orig;
+  size_t origlen;
+  int mapped;
+  struct lineindex lines;
+  int loadlines;
+  int loadpos;
+  struct loader load;
+  struct saver save;
+  struct journal journal;
+  struct addbuf add;
+  struct inbuf in;
+  struct pastebuf paste;
   int dirty;
   char* filename;
   char statusmsg[80];
   time_t statusmsg_time;
   struct editorSyntax *syntax;
+  const struct hltable *lexer;
+  erow **hlstale;
+  int nhlstale;
+  int hlstalecap;
+  unsigned int rowsgen;
+  struct highlighter hlw;
+  struct hlcache hlcache;
+  struct shadow shadow;
   struct termios orig_termios;
 };
 
@@ -113,32 +326,14 @@ struct editorConfig E;
 
 /*** filetypes ***/
 
-char *C_HL_extensions[] = {".c", ".h", ".cpp", NULL};
-char *C_HL_keywords[] = {
-  "switch", "if", "while", "for", "break", "continue", "return", "else",
-  "struct", "union", "typedef", "static", "enum", "class", "case", "include", "define",
-
-  "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
-  "void|", NULL
-};
-
-struct editorSyntax HLDB[] =
-{
-  {
-    "C",
-    C_HL_extensions,
-    C_HL_keywords,
-    "//", "/*", "*/",
-    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_FUNCTIONS
-  },
-};
-
-#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+#include "hltables.h"
 
 /*** prototypes ***/
 void editorSetStatusMessage(const char *fmt, ...);
 void editorMoveCursor(int key);
 void editorRefreshScreen();
+void editorIdle();
+int editorThreads();
 char* editorPrompt(char *prompt, void (*callback)(char *, int));
 
 /*** terminal ***/
@@ -152,6 +347,7 @@ void die(const char *s) {
 }
 
 void disableRawMode() {
+  write(STDOUT_FILENO, "\x1b[?2004l", 8);
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
     die("tcsetattr");
 }
@@ -169,85 +365,233 @@ void enableRawMode() {
   raw.c_cc[VTIME] = 1;
 
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-int editorReadKey() {
-  int nread;
-  unsigned char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN) die("read");
-  }
-
-  if (c == '\x1b') {
-    char seq[5];
-
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-
-    if (seq[0] == '[') {
-      if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-        if (seq[2] == '~') {
-          switch (seq[1]) {
-            case '1': return HOME_KEY;
-            case '3': return DEL_KEY;
-            case '4': return END_KEY;
-            case '5': return PAGE_UP;
-            case '6': return PAGE_DOWN;
-            case '7': return HOME_KEY;
-            case '8': return END_KEY;
-          }
-        } else if (seq[2] == ';') {
-          if (read(STDIN_FILENO, &seq[3], 1) != 1) return '\x1b';
-          if (read(STDIN_FILENO, &seq[4], 1) != 1) return '\x1b';
-          if (seq[1] == '1') {
-            if (seq[3] == '5') {
-              switch(seq[4]) {
-                case 'D': return CTRL_ARROW_LEFT;
-                case 'C': return CTRL_ARROW_RIGHT;
-                case 'A': return CTRL_ARROW_UP;
-                case 'B': return CTRL_ARROW_DOWN;
-              }
-            } else if (seq[3] == '6') {
-              switch (seq[4]) {
-                case 'D': return CTRL_SHIFT_ARROW_LEFT;
-                case 'C': return CTRL_SHIFT_ARROW_RIGHT;
-                case 'A': return CTRL_SHIFT_ARROW_UP;
-                case 'B': return CTRL_SHIFT_ARROW_DOWN;  
-              }
-            }
-          } else if (seq[1] == '3') {
-            if (seq[3] == '5' && seq[4] == '~') return CTRL_DELETE;
-            return '\x1b';
-          }
+/*
+ * Input is read in chunks into a ring buffer and parsed from there by a
+ * small state machine, so a burst of keys or a paste costs one read()
+ * rather than one per byte. A sequence whose start has arrived waits up
+ * to KILO_ESC_MS for the rest of it; after that a lone ESC is an ESC.
+ * With nothing running in the background, input is waited for without
+ * a timeout.
+ */
+
+#define INBUF_MASK (KILO_INBUF - 1)
+
+int editorInputLen() {
+  return E.in.tail - E.in.head;
+}
+
+unsigned char editorInputAt(int i) {
+  return E.in.buf[(E.in.head + i) & INBUF_MASK];
+}
+
+/* Waits up to 'ms' milliseconds, or for ever if 'ms' is negative, for
+ * input and reads as much of it as fits. Returns how many bytes came. */
+int editorInputFill(int ms) {
+  struct inbuf *in = &E.in;
+  unsigned int len = in->tail - in->head;
+  if (len == KILO_INBUF) return 0;
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+  int ready = poll(&pfd, 1, ms);
+  if (ready == -1 && errno != EINTR) die("poll");
+  if (ready <= 0) return 0;
+
+  unsigned int at = in->tail & INBUF_MASK;
+  unsigned int room = KILO_INBUF - len;
+  if (room > KILO_INBUF - at) room = KILO_INBUF - at;
+  ssize_t nread = read(STDIN_FILENO, in->buf + at, room);
+  if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+  if (nread <= 0) return 0;
+  in->tail += nread;
+  return nread;
+}
+
+/* Waits up to 'ms' milliseconds for input and returns whether some is
+ * waiting. */
+int editorInputWait(int ms) {
+  return editorInputLen() > 0 || editorInputFill(ms) > 0;
+}
+
+/* How long input may be waited for before editorIdle() has work to do. */
+int editorIdleWait() {
+  if (E.load.active || E.save.active || E.hlw.active || E.journal.len ||
+      (E.syntax && E.nhlstale))
+    return 100;
+  return -1;
+}
+
+int editorCsiKey(int final, const int *param, int nparam) {
+  int mod = nparam >= 2 ? param[1] : 1;
+  if (final == '~') {
+    switch (param[0]) {
+      case 1: return HOME_KEY;
+      case 3: return mod == 5 ? CTRL_DELETE : DEL_KEY;
+      case 4: return END_KEY;
+      case 5: return PAGE_UP;
+      case 6: return PAGE_DOWN;
+      case 7: return HOME_KEY;
+      case 8: return END_KEY;
+      case 200: return PASTE;
+    }
+    return '\x1b';
+  }
+  if (final == 'H') return HOME_KEY;
+  if (final == 'F') return END_KEY;
+  if (final < 'A' || final > 'D') return '\x1b';
+  static const int arrows[3][4] = {
+    {ARROW_UP, ARROW_DOWN, ARROW_RIGHT, ARROW_LEFT},
+    {CTRL_ARROW_UP, CTRL_ARROW_DOWN, CTRL_ARROW_RIGHT, CTRL_ARROW_LEFT},
+    {CTRL_SHIFT_ARROW_UP, CTRL_SHIFT_ARROW_DOWN, CTRL_SHIFT_ARROW_RIGHT,
+     CTRL_SHIFT_ARROW_LEFT},
+  };
+  if (mod == 5) return arrows[1][final - 'A'];
+  if (mod == 6) return arrows[2][final - 'A'];
+  if (mod == 1) return arrows[0][final - 'A'];
+  return '\x1b';
+}
+
+enum inputState { IN_GROUND, IN_ESC, IN_CSI, IN_SS3, IN_UTF8 };
+
+/*
+ * Parses the key at the head of the input and returns how many bytes it
+ * takes, or 0 when the input ends inside a sequence. With 'flush' such a
+ * cut-off sequence is taken as an ESC instead, or a cut-off UTF-8
+ * character as its lead byte. Bytes of other UTF-8 characters are passed
+ * on one at a time, as before, but only once the whole character is in.
+ */
+int editorParseKey(int *key, int flush) {
+  int len = editorInputLen();
+  int state = IN_GROUND;
+  int param[2] = {0, 0}, nparam = 0;
+  int lead = 0, need = 0;
+  for (int i = 0; ; i++) {
+    if (i == len) {
+      if (!flush || i == 0) return 0;
+      *key = state == IN_UTF8 ? (char)lead : '\x1b';
+      return state == IN_UTF8 ? 1 : i;
+    }
+    int c = editorInputAt(i);
+    switch (state) {
+      case IN_GROUND:
+        if (c == '\x1b') {
+          state = IN_ESC;
+        } else if (c >= 0xc2 && c <= 0xf4) {
+          lead = c;
+          need = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : 1;
+          state = IN_UTF8;
+        } else {
+          *key = (char)c;
+          return 1;
         }
-      } else {
-        switch (seq[1]) {
-          case 'A': return ARROW_UP;
-          case 'B': return ARROW_DOWN;
-          case 'C': return ARROW_RIGHT;
-          case 'D': return ARROW_LEFT;
-          case 'H': return HOME_KEY;
-          case 'F': return END_KEY;
+        break;
+      case IN_ESC:
+        if (c == '[') {
+          state = IN_CSI;
+        } else if (c == 'O') {
+          state = IN_SS3;
+        } else {
+          *key = '\x1b';
+          return i + 1;
         }
-      }
-    } else if (seq[0] == 'O') {
-      switch (seq[1]) {
-        case 'H': return HOME_KEY;
-        case 'F': return END_KEY;
-      }
+        break;
+      case IN_SS3:
+        *key = c == 'H' ? HOME_KEY : c == 'F' ? END_KEY : '\x1b';
+        return i + 1;
+      case IN_CSI:
+        if (c >= '0' && c <= '9') {
+          if (nparam == 0) nparam = 1;
+          if (nparam <= 2 && param[nparam-1] < 10000)
+            param[nparam-1] = param[nparam-1] * 10 + c - '0';
+        } else if (c == ';') {
+          nparam = nparam ? nparam + 1 : 2;
+        } else if (c >= 0x40 && c <= 0x7e) {
+          *key = editorCsiKey(c, param, nparam);
+          return i + 1;
+        } else if (c < 0x20 || c > 0x7e) {
+          *key = '\x1b';
+          return i;
+        }
+        break;
+      case IN_UTF8:
+        if ((c & 0xc0) != 0x80) {
+          *key = (char)lead;
+          return 1;
+        }
+        if (i == 1 && lead == 194 && (c == 158 || c == 132)) {
+          *key = c == 158 ? CTRL_SHIFT_ENTER : CTRL_SHIFT_D;
+          return 2;
+        }
+        if (--need == 0) {
+          *key = (char)lead;
+          return 1;
+        }
+        break;
     }
-    return '\x1b';
-  } else if (c == 194) {
-    if (read(STDIN_FILENO, &c, 1) != 1) return '\x1b';
-    switch (c) {
-      case (158): return CTRL_SHIFT_ENTER;
-      case (132): return CTRL_SHIFT_D;
-      default: return '\x1b';
+  }
+}
+
+/* Collects the bytes of a bracketed paste, up to the ESC [ 201 ~ that
+ * closes it, into E.paste. A paste whose input stops for KILO_PASTE_MS
+ * before the end marker ends there, without any part of the marker. */
+void editorReadPaste() {
+  static const char end[] = "\x1b[201~";
+  struct pastebuf *pb = &E.paste;
+  int matched = 0;
+  pb->len = 0;
+  while (matched < 6) {
+    int len = editorInputLen();
+    if (len == 0) {
+      if (editorInputFill(KILO_PASTE_MS)) continue;
+      pb->len -= matched;
+      return;
+    }
+    if (pb->len + len > pb->cap) {
+      while (pb->len + len > pb->cap) pb->cap = pb->cap ? pb->cap * 2 : 4096;
+      pb->buf = realloc(pb->buf, pb->cap);
+    }
+    int i = 0;
+    while (i < len && matched < 6) {
+      char c = editorInputAt(i++);
+      pb->buf[pb->len++] = c;
+      matched = c == end[matched] ? matched + 1 : c == end[0];
+    }
+    E.in.head += i;
+  }
+  pb->len -= 6;
+}
+
+int editorReadKey() {
+  int key, n;
+  while ((n = editorParseKey(&key, 0)) == 0) {
+    if (editorInputLen() > 0) {
+      if (!editorInputFill(KILO_ESC_MS)) n = editorParseKey(&key, 1);
+      if (n) break;
+    } else if (!editorInputFill(editorIdleWait())) {
+      editorIdle();
     }
-  } else {
-    return (char)c;
   }
+  E.in.head += n;
+  if (key == PASTE) editorReadPaste();
+  return key;
+}
+
+/* Milliseconds until the next frame may be drawn: frames are drawn at
+ * most KILO_FPS times a second, or as the KILO_FPS environment variable
+ * says, with 0 for no limit. */
+int editorFrameWait() {
+  static int frame_ms = -1;
+  if (frame_ms < 0) {
+    char *env = getenv("KILO_FPS");
+    long fps = env ? atol(env) : KILO_FPS;
+    frame_ms = fps > 0 ? 1000 / fps : 0;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long ms = (now.tv_sec - E.shadow.drawn.tv_sec) * 1000 +
+            (now.tv_nsec - E.shadow.drawn.tv_nsec) / 1000000;
+  return ms >= frame_ms ? 0 : frame_ms - ms;
 }
 
 int getCursorPosition(int *rows, int *cols) {
@@ -282,136 +626,976 @@ int getWindowSize(int *rows, int *cols) {
   }
 }
 
-/*** syntax highlighting ***/
+/*** line tree ***/
+
+/*
+ * Rows are kept in a treap ordered by line number. Each node stores the
+ * number of rows in its subtree, so finding, inserting or deleting the row
+ * at a given line is O(log n), and a row's line number is recomputed from
+ * the counts on its path to the root instead of being stored in the row.
+ *
+ * Lines of the opened file that were never looked at are not rows yet: a
+ * run node stands for 'run' consecutive lines starting at line 'runfrom'
+ * of E.orig, and is split when a row is needed from its middle.
+ */
+
+int rowCount(erow *t) {
+  return t ? t->count : 0;
+}
 
-int is_separator(char c) {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];#", c) != NULL;
+int rowWeight(erow *t) {
+  return t->run ? t->run : 1;
 }
 
-void editorUpdateSyntax(erow *row) {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
+erow *rowNewRun(int from, int n) {
+  erow *t = calloc(1, sizeof(erow));
+  t->prio = rand();
+  t->run = n;
+  t->runfrom = from;
+  t->count = n;
+  return t;
+}
 
-  if (E.syntax == NULL) return;
+void rowUpdate(erow *t) {
+  t->count = rowWeight(t) + rowCount(t->left) + rowCount(t->right);
+  if (t->left) t->left->parent = t;
+  if (t->right) t->right->parent = t;
+}
 
-  char** keywords = E.syntax->keywords;
+erow *rowMerge(erow *a, erow *b) {
+  if (!a) return b;
+  if (!b) return a;
+  if (a->prio > b->prio) {
+    a->right = rowMerge(a->right, b);
+    rowUpdate(a);
+    return a;
+  } else {
+    b->left = rowMerge(a, b->left);
+    rowUpdate(b);
+    return b;
+  }
+}
+
+void rowSplit(erow *t, int at, erow **l, erow **r) {
+  if (!t) {
+    *l = *r = NULL;
+    return;
+  }
+  int lcount = rowCount(t->left);
+  if (at <= lcount) {
+    rowSplit(t->left, at, l, &t->left);
+    rowUpdate(t);
+    *r = t;
+  } else if (at < lcount + rowWeight(t)) {
+    erow *tail = rowNewRun(t->runfrom + at - lcount, t->run - (at - lcount));
+    t->run = at - lcount;
+    *r = rowMerge(tail, t->right);
+    t->right = NULL;
+    rowUpdate(t);
+    *l = t;
+  } else {
+    rowSplit(t->right, at - lcount - rowWeight(t), &t->right, r);
+    rowUpdate(t);
+    *l = t;
+  }
+}
 
+erow *rowFirst(erow *t) {
+  if (t) while (t->left) t = t->left;
+  return t;
+}
+
+erow *rowNext(erow *row) {
+  if (row->right) return rowFirst(row->right);
+  while (row->parent && row == row->parent->right) row = row->parent;
+  return row->parent;
+}
+
+erow *rowPrev(erow *row) {
+  if (row->left) {
+    row = row->left;
+    while (row->right) row = row->right;
+    return row;
+  }
+  while (row->parent && row == row->parent->left) row = row->parent;
+  return row->parent;
+}
+
+void rowFix(erow *t) {
+  if (!t) return;
+  rowFix(t->left);
+  rowFix(t->right);
+  rowUpdate(t);
+}
+
+/* Builds a treap of rows[0..n), in order, in O(n): each row becomes the
+ * right child of the nearest earlier row with a higher priority, and
+ * adopts the rows it outranks as its left subtree. */
+erow *rowBuild(erow **rows, int n) {
+  if (n == 0) return NULL;
+  erow **stack = malloc(sizeof(erow *) * n);
+  int top = 0;
+  for (int i = 0; i < n; i++) {
+    erow *t = rows[i], *last = NULL;
+    t->left = t->right = t->parent = NULL;
+    t->prio = rand();
+    while (top && stack[top-1]->prio < t->prio) last = stack[--top];
+    t->left = last;
+    if (top) stack[top-1]->right = t;
+    stack[top++] = t;
+  }
+  erow *root = stack[0];
+  free(stack);
+  rowFix(root);
+  return root;
+}
+
+epiece editorOrigLine(int i);
+erow *editorRowLoadRange(int from, int n);
+
+int editorRowIndex(erow *row) {
+  int idx = rowCount(row->left);
+  for (; row->parent; row = row->parent) {
+    if (row == row->parent->right)
+      idx += rowCount(row->parent->left) + rowWeight(row->parent);
+  }
+  return idx;
+}
+
+erow *editorRowAt(int at) {
+  int line = at;
+  erow *t = E.rows;
+  while (t) {
+    int lcount = rowCount(t->left);
+    if (at < lcount) {
+      t = t->left;
+    } else if (at < lcount + rowWeight(t)) {
+      if (!t->run) return t;
+      return editorRowLoadRange(line, 1);
+    } else {
+      at -= lcount + rowWeight(t);
+      t = t->right;
+    }
+  }
+  return NULL;
+}
+
+erow *editorRowNext(erow *row) {
+  erow *next = rowNext(row);
+  if (next && next->run) return editorRowAt(editorRowIndex(row) + 1);
+  return next;
+}
+
+erow *editorRowPrev(erow *row) {
+  erow *prev = rowPrev(row);
+  if (prev && prev->run) return editorRowAt(editorRowIndex(row) - 1);
+  return prev;
+}
+
+void editorRowTreeInsert(int at, erow *row) {
+  erow *l, *r;
+  row->left = row->right = row->parent = NULL;
+  row->run = 0;
+  row->count = 1;
+  row->prio = rand();
+  E.rowsgen++;
+  if (at <= E.loadpos) E.loadpos++;
+  rowSplit(E.rows, at, &l, &r);
+  E.rows = rowMerge(rowMerge(l, row), r);
+  E.rows->parent = NULL;
+}
+
+erow *editorRowTreeRemove(int at) {
+  erow *l, *row, *r;
+  E.rowsgen++;
+  if (at < E.loadpos) E.loadpos--;
+  rowSplit(E.rows, at, &l, &r);
+  rowSplit(r, 1, &row, &r);
+  E.rows = rowMerge(l, r);
+  if (E.rows) E.rows->parent = NULL;
+  return row;
+}
+
+/*** piece table ***/
+
+/*
+ * The opened file is read once into E.orig and never modified. Everything
+ * typed afterwards is appended to the add buffer, whose chunks are never
+ * moved or freed. A row is just a list of pieces pointing into those two
+ * stores, so an unedited line costs no copy of its bytes, and editing a
+ * line only rewrites its piece list.
+ */
+
+const char *editorAddText(const char *s, int len) {
+  if (E.add.len + len > E.add.cap) {
+    E.add.cap = len > KILO_ADD_CHUNK ? len : KILO_ADD_CHUNK;
+    E.add.chunk = malloc(E.add.cap);
+    E.add.len = 0;
+  }
+  char *p = E.add.chunk + E.add.len;
+  memcpy(p, s, len);
+  E.add.len += len;
+  return p;
+}
+
+int editorAddExtend(epiece *p, char c) {
+  if (!E.add.chunk || p->s + p->len != E.add.chunk + E.add.len ||
+      E.add.len == E.add.cap)
+    return 0;
+  E.add.chunk[E.add.len++] = c;
+  p->len++;
+  return 1;
+}
+
+void editorRowInsertPiece(erow *row, int k, const char *s, int len) {
+  if (len == 0) return;
+  if (row->npieces == row->piececap) {
+    row->piececap *= 2;
+    if (row->pieces == &row->piece) {
+      row->pieces = malloc(sizeof(epiece) * row->piececap);
+      row->pieces[0] = row->piece;
+    } else {
+      row->pieces = realloc(row->pieces, sizeof(epiece) * row->piececap);
+    }
+  }
+  memmove(row->pieces + k + 1, row->pieces + k,
+          sizeof(epiece) * (row->npieces - k));
+  row->pieces[k].s = s;
+  row->pieces[k].len = len;
+  row->npieces++;
+}
+
+void editorRowRemovePiece(erow *row, int k) {
+  memmove(row->pieces + k, row->pieces + k + 1,
+          sizeof(epiece) * (row->npieces - k - 1));
+  row->npieces--;
+}
+
+/* Returns the piece holding byte 'at' and its offset in that piece, or
+ * npieces when 'at' is the end of the row. */
+int editorRowFindPiece(erow *row, int at, int *off) {
+  int k;
+  for (k = 0; k < row->npieces; k++) {
+    if (at < row->pieces[k].len) break;
+    at -= row->pieces[k].len;
+  }
+  *off = at;
+  return k;
+}
+
+char editorRowCharAt(erow *row, int at) {
+  int off;
+  int k = editorRowFindPiece(row, at, &off);
+  return k < row->npieces ? row->pieces[k].s[off] : '\0';
+}
+
+/*** gap buffer ***/
+
+/*
+ * A long row that is being typed into is copied once into a private buffer
+ * with a gap at the cursor, and its two pieces become the text on either
+ * side of the gap, so inserting or deleting at the cursor only moves an
+ * edge of the gap. Only one row is hot at a time. Before its pieces are
+ * shared with another row, or when editing moves to another long row, the
+ * gap is closed and the buffer becomes as immutable as the add buffer.
+ */
+
+void editorGapSync(erow *row) {
+  egap *g = row->gap;
+  row->npieces = 2;
+  row->pieces[0].s = g->buf;
+  row->pieces[0].len = g->start;
+  row->pieces[1].s = g->buf + g->end;
+  row->pieces[1].len = g->cap - g->end;
+}
+
+void editorRowCool(erow *row) {
+  egap *g = row->gap;
+  if (!g) return;
+  memmove(g->buf + g->start, g->buf + g->end, g->cap - g->end);
+  char *buf = realloc(g->buf, row->size ? row->size : 1);
+  row->npieces = 0;
+  editorRowInsertPiece(row, 0, buf, row->size);
+  free(g);
+  row->gap = NULL;
+  if (E.hot == row) E.hot = NULL;
+}
+
+void editorUpdateRow(erow *row);
+
+void editorRowHeat(erow *row) {
+  if (row->gap) return;
+  if (E.hot) editorRowCool(E.hot);
+
+  egap *g = malloc(sizeof(egap));
+  g->cap = row->size * 2;
+  g->buf = malloc(g->cap);
+  g->tabs = 0;
+  int len = 0;
+  for (int k = 0; k < row->npieces; k++) {
+    memcpy(g->buf + len, row->pieces[k].s, row->pieces[k].len);
+    len += row->pieces[k].len;
+  }
+  for (int j = 0; j < len; j++)
+    if (g->buf[j] == '\t') g->tabs++;
+  g->start = len;
+  g->end = g->cap;
+
+  if (row->piececap < 2) {
+    row->pieces = malloc(sizeof(epiece) * 2);
+    row->piececap = 2;
+  }
+  row->gap = g;
+  E.hot = row;
+  editorGapSync(row);
+  editorUpdateRow(row);
+}
+
+void editorGapMove(egap *g, int at) {
+  if (at < g->start) {
+    int n = g->start - at;
+    memmove(g->buf + g->end - n, g->buf + at, n);
+    g->start -= n;
+    g->end -= n;
+  } else if (at > g->start) {
+    int n = at - g->start;
+    memmove(g->buf + g->start, g->buf + g->end, n);
+    g->start += n;
+    g->end += n;
+  }
+}
+
+void editorGapInsert(erow *row, int at, char c) {
+  egap *g = row->gap;
+  if (g->start == g->end) {
+    int tail = g->cap - g->end;
+    g->cap *= 2;
+    g->buf = realloc(g->buf, g->cap);
+    memmove(g->buf + g->cap - tail, g->buf + g->end, tail);
+    g->end = g->cap - tail;
+    if (g->tabs == 0) {
+      row->render = realloc(row->render, g->cap + 1);
+      if (row->hl) row->hl = realloc(row->hl, g->cap);
+    }
+  }
+  editorGapMove(g, at);
+  g->buf[g->start++] = c;
+  if (c == '\t') g->tabs++;
+  editorGapSync(row);
+}
+
+void editorGapDelete(erow *row, int at) {
+  egap *g = row->gap;
+  char c;
+  if (at == g->start - 1) {
+    c = g->buf[--g->start];
+  } else {
+    editorGapMove(g, at);
+    c = g->buf[g->end++];
+  }
+  if (c == '\t') g->tabs--;
+  editorGapSync(row);
+}
+
+/* While a hot row has no tabs its render mirrors its bytes, so it can
+ * be patched in place instead of being rebuilt. */
+int editorRowRenderCap(erow *row) {
+  return (row->gap && row->gap->tabs == 0) ? row->gap->cap : row->rsize;
+}
+
+/* Copies the pieces covering [from, to) of row into out, which must have
+ * room for row->npieces entries. */
+int editorRowSlice(erow *row, int from, int to, epiece *out) {
+  editorRowCool(row);
+  int n = 0;
+  int pos = 0;
+  for (int k = 0; k < row->npieces && pos < to; k++) {
+    epiece p = row->pieces[k];
+    int lo = from > pos ? from - pos : 0;
+    int hi = to < pos + p.len ? to - pos : p.len;
+    pos += p.len;
+    if (lo >= hi) continue;
+    out[n].s = p.s + lo;
+    out[n].len = hi - lo;
+    n++;
+  }
+  return n;
+}
+
+/*** syntax highlighting ***/
+
+int editorRenderMatch(erow *row, int at, const char *s, int len) {
+  return at + len <= row->rsize && !memcmp(row->render + at, s, len);
+}
+
+/* Returns the length of the token starting at i: the run of characters
+ * up to the next separator. */
+int editorTokenAt(erow *row, int i) {
+  int n = i;
+  const unsigned char *plain = E.lexer->plain;
+  while (n < row->rsize) {
+    int cls = plain[(unsigned char)row->render[n]];
+    if (cls == HLC_SEP || cls == HLC_DOT) break;
+    n++;
+  }
+  return n - i;
+}
+
+/* Returns the HL_KEYWORD class of the n byte token s, or 0. */
+int editorKeyword(const char *s, int n) {
+  const struct kwtable *kw = &E.lexer->keywords;
+  if (!kw->slot || n == 0 || n > kw->maxlen) return 0;
+  const struct kwentry *e = &kw->slot[kwHash(s, n, kw->seed) & kw->mask];
+  if (e->len != n || memcmp(e->s, s, n)) return 0;
+  return e->hl;
+}
+
+/*
+ * Highlights row->render from i on. i must be the start of the row or
+ * follow a plain separator outside any string or comment. With until >= 0
+ * the old hl past 'until' is trusted: the pass stops at the first plain
+ * space from there on that it leaves unchanged, since nothing after it can
+ * change either, and returns -1. Otherwise returns whether the row ends
+ * inside a multi-line comment. Each byte costs one lookup in the tables
+ * hlgen compiled for E.syntax; only comment delimiters and tokens that may
+ * be keywords or calls look further ahead.
+ */
+int editorHighlightFrom(erow *row, int i, int in_comment, int until) {
+  const struct hltable *lx = E.lexer;
   char *scs = E.syntax->single_line_comment_start;
   char *mcs = E.syntax->multi_line_comment_start;
   char *mce = E.syntax->multi_line_comment_end;
 
-  int scs_len = scs ? strlen(scs) : 0;
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mce ? strlen(mce) : 0;
-
-  int prev_sep = 1;
-  int in_str = 0;
-  int in_comment = (row->idx > 0 && E.row[row->idx-1].hl_open_comment);
-  int i = 0;
+  int state = in_comment ? HLS_COMMENT : HLS_SEP;
   while (i < row->rsize) {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
-
-    if (scs_len && !in_str && !in_comment) {
-      if (!strncmp(scs, row->render + i, scs_len)) {
+    unsigned char c = row->render[i];
+    const struct hlmove *m = &lx->move[state][lx->cls[c]];
+
+    if (until >= 0 && i >= until && c == ' ' && state <= HLS_NUMBER &&
+        row->hl[i] == HL_NORMAL)
+      return -1;
+
+    if (m->action == HLA_DELIM) {
+      if (state == HLS_COMMENT) {
+        if (editorRenderMatch(row, i, mce, lx->mce_len)) {
+          memset(row->hl + i, HL_MLCOMMENT, lx->mce_len);
+          i += lx->mce_len;
+          state = HLS_SEP;
+          continue;
+        }
+      } else if (lx->scs_len && editorRenderMatch(row, i, scs, lx->scs_len)) {
         memset(row->hl + i, HL_COMMENT, row->rsize - i);
         break;
+      } else if (lx->mcs_len && editorRenderMatch(row, i, mcs, lx->mcs_len)) {
+        memset(row->hl + i, HL_MLCOMMENT, lx->mcs_len);
+        i += lx->mcs_len;
+        state = HLS_COMMENT;
+        continue;
       }
+      m = &lx->move[state][lx->plain[c]];
     }
 
-    if (mcs_len && mce_len && !in_str) {
-      if (in_comment) {
-        row->hl[i] = HL_MLCOMMENT;
-        if (!strncmp(row->render + i, mce, mce_len)) {
-          memset(row->hl+i, HL_MLCOMMENT, mce_len);
-          i += mce_len;
-          in_comment = 0;
-          prev_sep = 1;
-          continue;
-        } else {
-          i++;
-          continue;
-        }
-      } else if (!strncmp(row->render + i, mcs, mcs_len)) {
-          memset(row->hl+i, HL_MLCOMMENT, mcs_len);
-          i += mcs_len;
-          in_comment = 1;
-          continue;
+    /* Keywords and calls are both decided by the token at i alone: a
+     * call is a token followed directly by '('. */
+    if (m->action == HLA_TOKEN) {
+      int n = editorTokenAt(row, i);
+      int kw = editorKeyword(row->render + i, n);
+      if (!kw && (E.syntax->flags & HL_HIGHLIGHT_FUNCTIONS) &&
+          i + n < row->rsize && row->render[i + n] == '(')
+        kw = HL_FUNCTION;
+      if (kw) {
+        memset(row->hl + i, kw, n);
+        i += n;
+        state = HLS_WORD;
+        continue;
       }
+    } else if (m->action == HLA_ESCAPE && i + 1 < row->rsize) {
+      row->hl[i++] = m->hl;
     }
 
-    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-      if (in_str) {
-        row->hl[i] = HL_STRING;
-        if (c == '\\' && i+1 < row->rsize) {
-          row->hl[i+1] = HL_STRING;
-          i += 2;
-          continue;
-        }
-        if (c == in_str) in_str = 0;
-        i++;
-        prev_sep = 1;
-        continue;
-      } else {
-        if (c == '"' || c == '\'') {
-          in_str = c;
-          row->hl[i] = HL_STRING;
-          i++;
-          continue;
-        } 
-      }
+    row->hl[i++] = m->hl;
+    state = m->next;
+  }
+  return state == HLS_COMMENT;
+}
+
+/*
+ * A change to the comment state a row ends in is carried down the rows
+ * below it, but only as far as the bottom of the screen. There the next
+ * row is marked ROW_HL_STALE and remembered in E.hlstale, and the rest of
+ * the pass is left to the highlight worker, or finished on the main thread
+ * if those rows come into view first.
+ */
+void editorHlStaleMark(erow *row) {
+  if (row->flags & ROW_HL_STALE) return;
+  row->flags |= ROW_HL_STALE;
+  if (E.nhlstale == E.hlstalecap) {
+    E.hlstalecap = E.hlstalecap ? E.hlstalecap * 2 : 8;
+    E.hlstale = realloc(E.hlstale, sizeof(erow *) * E.hlstalecap);
+  }
+  E.hlstale[E.nhlstale++] = row;
+}
+
+void editorHlStaleDrop(erow *row) {
+  if (!(row->flags & ROW_HL_STALE)) return;
+  row->flags &= ~ROW_HL_STALE;
+  for (int k = 0; k < E.nhlstale; k++) {
+    if (E.hlstale[k] == row) {
+      E.hlstale[k] = E.hlstale[--E.nhlstale];
+      break;
     }
+  }
+}
 
-    if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-        (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
-        i++;
-        prev_sep = 0;
-        continue;
+/*
+ * Rows highlighted again with the same render and entry state, as after a
+ * duplicate, a move or retyping a line, take their hl from a direct-mapped
+ * cache keyed by a hash of the render, the entry state and the syntax.
+ * Entries keep their own copy of the render, so a collision costs a miss
+ * and never wrong colours. The highlight worker and its helper threads
+ * look rows up and enter them too, under the cache's lock.
+ */
+uint64_t editorHlHash(const char *s, int len, int in, int syntax) {
+  uint64_t h = 0x9e3779b97f4a7c15ull ^ ((uint64_t)syntax << 32) ^
+               ((uint64_t)len << 1) ^ in;
+  int k = 0;
+  for (; k + 8 <= len; k += 8) {
+    uint64_t w;
+    memcpy(&w, s + k, 8);
+    h = (h ^ w) * 0xff51afd7ed558ccdull;
+    h ^= h >> 32;
+  }
+  uint64_t w = 0;
+  memcpy(&w, s + k, len - k);
+  h = (h ^ w) * 0xff51afd7ed558ccdull;
+  return h ^ (h >> 29);
+}
+
+/* Copies the cached hl of 'row' entered in state 'in' and returns the
+ * state the row ends in, or -1 on a miss. */
+int editorHlCacheGet(erow *row, int in, uint64_t hash) {
+  struct hlcache *c = &E.hlcache;
+  int syntax = E.syntax - HLDB + 1;
+  pthread_mutex_lock(&c->lock);
+  struct hlcentry *e = c->slot ? &c->slot[hash % KILO_HLCACHE_SLOTS] : NULL;
+  if (!e || e->hash != hash || e->syntax != syntax || e->in != in ||
+      e->rsize != row->rsize || memcmp(e->render, row->render, row->rsize)) {
+    c->misses++;
+    pthread_mutex_unlock(&c->lock);
+    return -1;
+  }
+  c->hits++;
+  memcpy(row->hl, e->render + e->rsize, row->rsize);
+  int out = e->out;
+  pthread_mutex_unlock(&c->lock);
+  return out;
+}
+
+void editorHlCachePut(erow *row, int in, int out, uint64_t hash) {
+  struct hlcache *c = &E.hlcache;
+  pthread_mutex_lock(&c->lock);
+  if (!c->slot) c->slot = calloc(KILO_HLCACHE_SLOTS, sizeof(*c->slot));
+  struct hlcentry *e = &c->slot[hash % KILO_HLCACHE_SLOTS];
+  if (!e->render || e->rsize < row->rsize)
+    e->render = realloc(e->render, row->rsize * 2 + 1);
+  memcpy(e->render, row->render, row->rsize);
+  memcpy(e->render + row->rsize, row->hl, row->rsize);
+  e->hash = hash;
+  e->rsize = row->rsize;
+  e->syntax = E.syntax - HLDB + 1;
+  e->in = in;
+  e->out = out;
+  pthread_mutex_unlock(&c->lock);
+}
+
+void editorRowFresh(erow *row);
+int editorHlNeeds(erow *row);
+
+/* Highlights one row from the state its predecessor ends in. Returns
+ * whether the state the row itself ends in changed. */
+int editorHighlightRow(erow *row) {
+  if (row->flags & ROW_STALE) return 0;
+  int pending = row->flags & ROW_HL_STALE;
+  editorHlStaleDrop(row);
+  row->flags &= ~ROW_HL_NONE;
+  row->hlgen++;
+  if (E.syntax == NULL) {
+    free(row->hl);
+    row->hl = NULL;
+    return 0;
+  }
+
+  /* Below lines not loaded yet the row is taken to start outside any
+   * comment. Loading them later corrects it by propagation. */
+  erow *prev = rowPrev(row);
+  if (prev && prev->run) prev = NULL;
+  if (prev) editorRowFresh(prev);
+
+  row->hl = realloc(row->hl, editorRowRenderCap(row));
+  int in = prev && prev->hl_open_comment;
+  int in_comment = -1;
+  uint64_t hash = 0;
+  int cached = row->rsize <= KILO_HLCACHE_MAXLEN;
+  if (cached) {
+    hash = editorHlHash(row->render, row->rsize, in, E.syntax - HLDB);
+    in_comment = editorHlCacheGet(row, in, hash);
+  }
+  if (in_comment < 0) {
+    memset(row->hl, HL_NORMAL, row->rsize);
+    in_comment = editorHighlightFrom(row, 0, in, -1);
+    if (cached) editorHlCachePut(row, in, in_comment, hash);
+  }
+  int changed = (row->hl_open_comment != in_comment);
+  row->hl_open_comment = in_comment;
+
+  /* A pass that was to start here goes on from the next row if that one
+   * has yet to be lexed at all. */
+  erow *next = pending ? rowNext(row) : NULL;
+  if (next && !next->run && editorHlNeeds(next)) editorHlStaleMark(next);
+  return changed;
+}
+
+/* Re-highlights up to 'budget' rows below 'row' for as long as the state
+ * they start in keeps changing, and leaves the rest to a later pass. */
+void editorPropagateComment(erow *row, int budget) {
+  erow *next = rowNext(row);
+  while (next && !next->run && !(next->flags & ROW_STALE)) {
+    if (budget-- <= 0) {
+      editorHlStaleMark(next);
+      return;
+    }
+    if (!editorHighlightRow(next)) return;
+    next = rowNext(next);
+  }
+}
+
+/* Rows from 'row' to the bottom of the screen. */
+int editorScreenBudget(erow *row) {
+  int budget = E.rowoff + E.screenrows - editorRowIndex(row);
+  return budget > 0 ? budget : 0;
+}
+
+void editorSetOpenComment(erow *row, int in_comment) {
+  int changed = (row->hl_open_comment != in_comment);
+  row->hl_open_comment = in_comment;
+  if (changed) editorPropagateComment(row, editorScreenBudget(row) - 1);
+}
+
+void editorUpdateSyntax(erow *row) {
+  if (editorHighlightRow(row))
+    editorPropagateComment(row, editorScreenBudget(row) - 1);
+}
+
+/* Finishes the pending passes that start on screen. Those that start
+ * above it are left to the worker. */
+void editorHighlightPending() {
+  int k = 0;
+  while (k < E.nhlstale) {
+    erow *row = E.hlstale[k];
+    int at = editorRowIndex(row);
+    if ((row->flags & ROW_STALE) || at < E.rowoff ||
+        at >= E.rowoff + E.screenrows) {
+      k++;
+      continue;
+    }
+    editorUpdateSyntax(row);
+    k = 0;
+  }
+}
+
+/* Whether a pass that starts above row 'at' is still pending. Rows from
+ * 'at' on may then hold colours from before the edit that started it. */
+int editorHlPendingAbove(int at) {
+  for (int k = 0; k < E.nhlstale; k++)
+    if (editorRowIndex(E.hlstale[k]) < at) return 1;
+  return 0;
+}
+
+int editorHlNeeds(erow *row) {
+  return row->flags & (ROW_STALE | ROW_HL_STALE | ROW_HL_NONE);
+}
+
+int editorRenderPieces(const epiece *pieces, int npieces, char *out);
+
+/* Lexes one item from 'in_comment' and returns the state it ends in. */
+int editorHighlightItem(struct hlitem *it, int in_comment) {
+  erow tmp;
+  memset(&tmp, 0, sizeof(tmp));
+  tmp.render = (char *)it->render;
+  tmp.rsize = it->rsize;
+  if (it->stale && !it->out_render && memchr(it->render, '\t', it->rsize)) {
+    epiece p = {it->render, it->rsize};
+    int tabs = 0;
+    for (int j = 0; j < p.len; j++) if (p.s[j] == '\t') tabs++;
+    it->out_render = malloc(p.len + tabs*(KILO_TAB_STOP - 1) + 1);
+    it->out_rsize = editorRenderPieces(&p, 1, it->out_render);
+  } else if (!it->out_render) {
+    it->out_rsize = it->rsize;
+  }
+  if (it->out_render) tmp.render = it->out_render;
+  tmp.rsize = it->out_rsize;
+
+  if (!it->hl) it->hl = malloc(tmp.rsize ? tmp.rsize : 1);
+  tmp.hl = it->hl;
+  it->open = -1;
+  uint64_t hash = 0;
+  int cached = tmp.rsize <= KILO_HLCACHE_MAXLEN;
+  if (cached) {
+    hash = editorHlHash(tmp.render, tmp.rsize, in_comment, E.syntax - HLDB);
+    it->open = editorHlCacheGet(&tmp, in_comment, hash);
+  }
+  if (it->open < 0) {
+    memset(tmp.hl, HL_NORMAL, tmp.rsize);
+    it->open = editorHighlightFrom(&tmp, 0, in_comment, -1);
+    if (cached) editorHlCachePut(&tmp, in_comment, it->open, hash);
+  }
+  return it->open;
+}
+
+/*
+ * A batch of rows that mostly need highlighting, as after a change of
+ * syntax, is split into chunks lexed on several threads. Every chunk but
+ * the first is started outside any comment; the chunks are then checked in
+ * order, and one whose real entry state differs is re-lexed from it until
+ * a row ends in the same state as its speculative run did, since from
+ * there on the speculative results are exact.
+ */
+struct hlchunk {
+  struct hlitem *items;
+  int n;
+  int in_comment;
+};
+
+void *editorHighlightChunk(void *arg) {
+  struct hlchunk *c = arg;
+  int in_comment = c->in_comment;
+  for (int k = 0; k < c->n; k++)
+    in_comment = editorHighlightItem(&c->items[k], in_comment);
+  return NULL;
+}
+
+int editorHighlightParallel(struct highlighter *job) {
+  int nthreads = editorThreads();
+  if (job->nitems / KILO_HL_CHUNK_MIN < nthreads)
+    nthreads = job->nitems / KILO_HL_CHUNK_MIN;
+  if (nthreads < 1) nthreads = 1;
+
+  struct hlchunk chunks[nthreads];
+  pthread_t tids[nthreads];
+  int started[nthreads];
+  int i;
+  for (i = 0; i < nthreads; i++) {
+    int from = job->nitems / nthreads * i;
+    int to = (i == nthreads - 1) ? job->nitems : job->nitems / nthreads * (i + 1);
+    chunks[i].items = job->items + from;
+    chunks[i].n = to - from;
+    chunks[i].in_comment = i == 0 ? job->in_comment : 0;
+  }
+  for (i = 1; i < nthreads; i++)
+    started[i] = pthread_create(&tids[i], NULL, editorHighlightChunk,
+                                &chunks[i]) == 0;
+  editorHighlightChunk(&chunks[0]);
+  for (i = 1; i < nthreads; i++) {
+    if (started[i]) pthread_join(tids[i], NULL);
+    else editorHighlightChunk(&chunks[i]);
+  }
+
+  int in_comment = chunks[0].items[chunks[0].n - 1].open;
+  for (i = 1; i < nthreads; i++) {
+    if (in_comment != chunks[i].in_comment) {
+      for (int k = 0; k < chunks[i].n; k++) {
+        int guess = chunks[i].items[k].open;
+        in_comment = editorHighlightItem(&chunks[i].items[k], in_comment);
+        if (in_comment == guess) break;
       }
     }
+    in_comment = chunks[i].items[chunks[i].n - 1].open;
+  }
+  return job->nitems;
+}
+
+/*
+ * The highlight worker re-lexes rows off the screen. The main thread hands
+ * it a batch of rows starting at a pending pass, with the render of each
+ * (a copy where the row owns it) and the generation of its highlighting.
+ * The worker lexes down the batch while the state carried from row to row
+ * differs from what the row had, or the row was never highlighted. Results
+ * are installed only if the line tree has not changed shape since, and
+ * only up to the first row the main thread has re-highlighted meanwhile.
+ */
+void *editorHighlightWorker(void *arg) {
+  struct highlighter *job = arg;
+  int in_comment = job->in_comment;
+  int k;
+  if (job->parallel) {
+    k = editorHighlightParallel(job);
+  } else {
+    for (k = 0; k < job->nitems; k++) {
+      struct hlitem *it = &job->items[k];
+      if (k > 0 && in_comment == job->items[k-1].old_open && !it->needs)
+        break;
+      in_comment = editorHighlightItem(it, in_comment);
+    }
+  }
+
+  pthread_mutex_lock(&job->lock);
+  job->ndone = k;
+  job->done = 1;
+  pthread_mutex_unlock(&job->lock);
+  return NULL;
+}
+
+/* Hands the first pending pass to the worker. */
+void editorHighlightStart() {
+  struct highlighter *job = &E.hlw;
+  if (job->active || E.syntax == NULL || E.nhlstale == 0) return;
+
+  erow *first = E.hlstale[0];
+  erow *prev = rowPrev(first);
+  int cap = 256, n = 0, needs = 0;
+  job->items = malloc(sizeof(struct hlitem) * cap);
+  for (erow *row = first; row && !row->run && n < KILO_HL_BATCH;
+       row = rowNext(row)) {
+    if (n == cap) {
+      cap *= 2;
+      job->items = realloc(job->items, sizeof(struct hlitem) * cap);
+    }
+    struct hlitem *it = &job->items[n++];
+    memset(it, 0, sizeof(*it));
+    it->row = row;
+    it->stale = (row->flags & ROW_STALE) != 0;
+    it->needs = editorHlNeeds(row) != 0;
+    needs += it->needs;
+    it->old_open = row->hl_open_comment;
+    it->gen = row->hlgen;
+    if (it->stale) {
+      it->render = row->npieces ? row->pieces[0].s : "";
+      it->rsize = row->npieces ? row->pieces[0].len : 0;
+    } else if (row->flags & ROW_RENDER_OWNED) {
+      char *copy = malloc(row->rsize ? row->rsize : 1);
+      memcpy(copy, row->render, row->rsize);
+      it->render = copy;
+      it->rsize = row->rsize;
+      it->copied = 1;
+    } else {
+      it->render = row->render;
+      it->rsize = row->rsize;
+    }
+  }
+  job->nitems = n;
+  job->ndone = 0;
+  job->done = 0;
+  job->in_comment = prev && !prev->run && prev->hl_open_comment;
+  job->parallel = n >= 2 * KILO_HL_CHUNK_MIN && needs > n / 2;
+  job->rowsgen = E.rowsgen;
+  if (pthread_create(&job->tid, NULL, editorHighlightWorker, job) == 0) {
+    job->active = 1;
+  } else {
+    free(job->items);
+    job->items = NULL;
+  }
+}
 
-    if (prev_sep) {
-      char **keyword;
-      for(keyword = keywords; *keyword; keyword++) {
-        int klen = strlen(*keyword);
-        int kw2 = (*keyword)[klen-1] == '|';
-        if (kw2) klen--;
-
-        if (!strncmp(row->render + i, *keyword, klen) &&
-          is_separator(row->render[i+klen])) {
-          memset(row->hl + i, kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
-          break;
+/* Installs a finished highlight job, waiting for it when 'wait' is set,
+ * and starts the next one. Returns whether rows on screen changed. */
+int editorHighlightPoll(int wait) {
+  struct highlighter *job = &E.hlw;
+  if (!job->active) {
+    if (!wait) editorHighlightStart();
+    return 0;
+  }
+  pthread_mutex_lock(&job->lock);
+  int done = job->done;
+  pthread_mutex_unlock(&job->lock);
+  if (!done && !wait) return 0;
+
+  pthread_join(job->tid, NULL);
+  job->active = 0;
+
+  int visible = 0;
+  int applied = 0;
+  erow *first = job->items[0].row;
+  erow *prev = job->rowsgen == E.rowsgen ? rowPrev(first) : NULL;
+  if (job->rowsgen == E.rowsgen && E.syntax &&
+      (prev && !prev->run && prev->hl_open_comment) == job->in_comment) {
+    int at = editorRowIndex(first);
+    for (; applied < job->ndone; applied++) {
+      struct hlitem *it = &job->items[applied];
+      erow *row = it->row;
+      if (row->hlgen != it->gen) break;
+      if (it->stale) {
+        row->flags &= ~ROW_STALE;
+        if (it->out_render) {
+          row->render = it->out_render;
+          row->flags |= ROW_RENDER_OWNED;
+          it->out_render = NULL;
+        } else {
+          row->render = (char *)it->render;
         }
+        row->rsize = it->out_rsize;
       }
-      if (*keyword != NULL) {
-        prev_sep = 0;
-        continue;
-      } else if (E.syntax->flags & HL_HIGHLIGHT_FUNCTIONS &&
-                  i+1 < row->rsize) {
-        char* next_space = strchr(row->render + i + 1, ' ');
-        char* next_paren = strchr(row->render + i + 1, '(');
-
-        if (next_paren && (!next_space || next_space - next_paren > 0)) {
-          memset(row->hl + i, HL_FUNCTION, next_paren - row->render - i);
-          i += next_paren - row->render - i;
-          prev_sep = 0;
-          continue;
-        }
+      if (row->gap) {
+        row->hl = realloc(row->hl, editorRowRenderCap(row));
+        memcpy(row->hl, it->hl, row->rsize);
+      } else {
+        free(row->hl);
+        row->hl = it->hl;
+        it->hl = NULL;
       }
+      row->hl_open_comment = it->open;
+      row->flags &= ~ROW_HL_NONE;
+      row->hlgen++;
+      editorHlStaleDrop(row);
+      if (at + applied >= E.rowoff && at + applied < E.rowoff + E.screenrows)
+        visible = 1;
+    }
+    /* The pass goes on from wherever the job stopped. */
+    if (applied) {
+      struct hlitem *last = &job->items[applied-1];
+      erow *next = rowNext(last->row);
+      if (next && !next->run &&
+          (last->open != last->old_open || editorHlNeeds(next)))
+        editorHlStaleMark(next);
     }
-
-    prev_sep = is_separator(c);
-    ++i;
   }
 
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  if (changed && row->idx+1 < E.numrows)
-    editorUpdateSyntax(E.row + row->idx + 1);
+  for (int k = 0; k < job->nitems; k++) {
+    struct hlitem *it = &job->items[k];
+    if (it->copied) free((char *)it->render);
+    free(it->out_render);
+    free(it->hl);
+  }
+  free(job->items);
+  job->items = NULL;
+  if (!wait) editorHighlightStart();
+  return visible;
+}
 
+/* Re-highlights a row whose render changed only in [from, to). The pass
+ * restarts at a plain space with another space between it and the edit,
+ * so no earlier token can look ahead into the change. */
+void editorUpdateSyntaxSpan(erow *row, int from, int to) {
+  if (E.syntax == NULL) return;
+  if (row->flags & ROW_HL_NONE) {
+    editorUpdateSyntax(row);
+    return;
+  }
+  row->hlgen++;
+
+  int start = from;
+  while (start > 0 && row->render[start-1] != ' ') start--;
+  if (start > 0) start--;
+  while (start > 0 && !(row->render[start-1] == ' ' &&
+                        row->hl[start-1] == HL_NORMAL))
+    start--;
+
+  int in_comment = 0;
+  if (start == 0) {
+    erow *prev = rowPrev(row);
+    in_comment = prev && !prev->run && prev->hl_open_comment;
+  }
+  in_comment = editorHighlightFrom(row, start, in_comment, to);
+  if (in_comment >= 0) editorSetOpenComment(row, in_comment);
 }
 
 int editorSyntaxToColor(int hl) {
@@ -428,8 +1612,51 @@ int editorSyntaxToColor(int hl) {
   }
 }
 
+/* The escape selecting the colour of each hl class, formatted once. Plain
+ * text has colour -1 and resets to the default. */
+struct hlcolor {
+  int color;
+  int len;
+  char esc[8];
+};
+
+const struct hlcolor *editorHlColors() {
+  static struct hlcolor colors[256];
+  static int built = 0;
+  if (!built) {
+    for (int hl = 0; hl < 256; hl++) {
+      struct hlcolor *c = &colors[hl];
+      c->color = hl == HL_NORMAL ? -1 : editorSyntaxToColor(hl);
+      c->len = c->color == -1 ? snprintf(c->esc, sizeof(c->esc), "\x1b[39m") :
+        snprintf(c->esc, sizeof(c->esc), "\x1b[%dm", c->color);
+    }
+    built = 1;
+  }
+  return colors;
+}
+
+/* Drops the highlighting of every row after a change of syntax. Rows are
+ * drawn plain until a pass from the first row reaches them. */
+void editorResetSyntax() {
+  while (E.nhlstale) editorHlStaleDrop(E.hlstale[0]);
+  erow *first = NULL;
+  for (erow *row = rowFirst(E.rows); row; row = rowNext(row)) {
+    if (row->run) continue;
+    if (!first) first = row;
+    if (row->flags & ROW_STALE) continue;
+    free(row->hl);
+    row->hl = NULL;
+    row->hl_open_comment = 0;
+    row->hlgen++;
+    if (E.syntax) row->flags |= ROW_HL_NONE;
+  }
+  if (E.syntax && first) editorHlStaleMark(first);
+}
+
 void editorSelectSyntaxHighlight() {
+  editorHighlightPoll(1);
   E.syntax = NULL;
+  E.lexer = NULL;
   if (E.filename == NULL) return;
 
   char *ext = strrchr(E.filename, '.');
@@ -441,35 +1668,140 @@ void editorSelectSyntaxHighlight() {
       if ((is_ext && !strcmp(ext, *filematch)) ||
         (!is_ext && strstr(E.filename, *filematch))) {
         E.syntax = HLDB + i;
-
-        for (int i = 0; i < E.numrows; ++i) {
-          editorUpdateSyntax(E.row + i);
-        }
+        E.lexer = HLTABLES + i;
+        editorResetSyntax();
         return;
       }
       filematch++;
     }
   }
+  editorResetSyntax();
+}
+
+/*** journal ***/
+
+/*
+ * Every primitive edit is appended to the journal, a hidden file next to
+ * the one being edited, so that a crash loses at most the last few hundred
+ * milliseconds of work. A record is an op byte and two 32-bit arguments,
+ * followed by the row's bytes for J_INSERT_ROW and the character for
+ * J_INSERT_CHAR. Records collect in memory and are written out every
+ * KILO_JOURNAL_MS; a syncer thread fdatasyncs them on the same period, so
+ * a keystroke only ever costs a memcpy. The header identifies the saved
+ * file the records apply to, and a completed save drops the records it
+ * covers.
+ */
+
+struct jheader {
+  char magic[8];
+  int64_t size;
+  int64_t sec;
+  int64_t nsec;
+};
+
+#define JOURNAL_RECORD 9
+
+void editorJournal(int op, int row, int arg, const epiece *data, int ndata) {
+  struct journal *j = &E.journal;
+  if (j->fd == -1 || j->replaying) return;
+  size_t need = JOURNAL_RECORD;
+  for (int k = 0; k < ndata; k++) need += data[k].len;
+  if (j->len + need > j->cap) {
+    while (j->len + need > j->cap) j->cap = j->cap ? j->cap * 2 : 4096;
+    j->buf = realloc(j->buf, j->cap);
+  }
+  if (j->len == 0) clock_gettime(CLOCK_MONOTONIC, &j->since);
+
+  char *p = j->buf + j->len;
+  int32_t a = row, b = arg;
+  p[0] = op;
+  memcpy(p + 1, &a, 4);
+  memcpy(p + 5, &b, 4);
+  p += JOURNAL_RECORD;
+  for (int k = 0; k < ndata; k++) {
+    memcpy(p, data[k].s, data[k].len);
+    p += data[k].len;
+  }
+  j->len += need;
+}
+
+/* Writes out buffered records once they are KILO_JOURNAL_MS old, or right
+ * away with 'force'. Records a write fails on stay buffered and are tried
+ * again on the next flush, and the status bar says so meanwhile. */
+void editorJournalFlush(int force) {
+  struct journal *j = &E.journal;
+  if (j->fd == -1 || j->len == 0) return;
+  if (!force) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (now.tv_sec - j->since.tv_sec) * 1000 +
+              (now.tv_nsec - j->since.tv_nsec) / 1000000;
+    if (ms < KILO_JOURNAL_MS) return;
+  }
+  size_t done = 0;
+  int err = 0;
+  while (done < j->len) {
+    ssize_t w = pwrite(j->fd, j->buf + done, j->len - done, j->size + done);
+    if (w == -1 && errno == EINTR) continue;
+    if (w <= 0) {
+      err = w == -1 ? errno : EIO;
+      break;
+    }
+    done += w;
+  }
+  j->size += done;
+  memmove(j->buf, j->buf + done, j->len - done);
+  j->len -= done;
+  if (j->len && !j->failing)
+    editorSetStatusMessage("Can't write journal: %s", strerror(err));
+  j->failing = j->len != 0;
+  pthread_mutex_lock(&j->lock);
+  j->unsynced = 1;
+  pthread_cond_signal(&j->wake);
+  pthread_mutex_unlock(&j->lock);
+}
+
+/* Syncs the journal at most every KILO_JOURNAL_MS, and sleeps until
+ * something is written to it. */
+void *editorJournalSyncer(void *arg) {
+  struct journal *j = arg;
+  for (;;) {
+    pthread_mutex_lock(&j->lock);
+    while (!j->unsynced) pthread_cond_wait(&j->wake, &j->lock);
+    int fd = j->fd;
+    j->unsynced = 0;
+    pthread_mutex_unlock(&j->lock);
+    if (fd != -1) fdatasync(fd);
+    usleep(KILO_JOURNAL_MS * 1000);
+  }
+  return NULL;
 }
 
 /*** row operations ***/
 
 int editorRowCxToRx(erow *row, int cx) {
+  if (row->gap && row->gap->tabs == 0) return cx;
   int rx = 0;
   int j;
-  for (j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t')
-      rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-    rx++;
+  for (int k = 0; k < row->npieces && cx > 0; k++) {
+    const char *s = row->pieces[k].s;
+    int n = row->pieces[k].len < cx ? row->pieces[k].len : cx;
+    for (j = 0; j < n; j++) {
+      if (s[j] == '\t')
+        rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+      rx++;
+    }
+    cx -= n;
   }
   return rx;
 }
 int editorRowRxToCx(erow *row, int rx) {
+  if (row->gap && row->gap->tabs == 0) return rx < row->size ? rx : row->size;
   int cx = 0;
   int j = 0;
   int i;
-  for (i = 0, j = 0; i < rx; i++, j++) {
-    if (row->chars[j] == '\t') {
+  for (i = 0, j = 0; i < rx && j < row->size; i++, j++) {
+    if (editorRowCharAt(row, j) == '\t') {
       i += (KILO_TAB_STOP - 1) - (i % KILO_TAB_STOP);
     }
     cx++;
@@ -477,62 +1809,162 @@ int editorRowRxToCx(erow *row, int rx) {
   return cx;
 }
 
-void editorUpdateRow(erow *row) {
+/* Renders pieces into out, expanding tabs. Returns the length. */
+int editorRenderPieces(const epiece *pieces, int npieces, char *out) {
+  int idx = 0;
+  for (int k = 0; k < npieces; k++) {
+    const char *s = pieces[k].s;
+    for (int j = 0; j < pieces[k].len; j++) {
+      if (s[j] == '\t') {
+        out[idx++] = ' ';
+        while (idx % KILO_TAB_STOP != 0) out[idx++] = ' ';
+      } else {
+        out[idx++] = s[j];
+      }
+    }
+  }
+  out[idx] = '\0';
+  return idx;
+}
+
+void editorUpdateRender(erow *row) {
   int tabs = 0;
-  int j;
-  for (j = 0; j < row->size; j++)
-    if (row->chars[j] == '\t') tabs++;
+  int j, k;
+  row->flags &= ~ROW_STALE;
+  for (k = 0; k < row->npieces; k++)
+    for (j = 0; j < row->pieces[k].len; j++)
+      if (row->pieces[k].s[j] == '\t') tabs++;
+
+  if (row->flags & ROW_RENDER_OWNED) free(row->render);
+  row->flags &= ~ROW_RENDER_OWNED;
+
+  /* A contiguous line without tabs renders as itself. */
+  if (tabs == 0 && row->npieces <= 1) {
+    row->render = row->npieces ? (char *)row->pieces[0].s : "";
+    row->rsize = row->size;
+    return;
+  }
 
-  free(row->render);
-  row->render = malloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1);
+  if (row->gap && tabs == 0)
+    row->render = malloc(row->gap->cap + 1);
+  else
+    row->render = malloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1);
+  row->flags |= ROW_RENDER_OWNED;
+  row->rsize = editorRenderPieces(row->pieces, row->npieces, row->render);
+}
 
-  int idx = 0;
-  for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
-    } else {
-      row->render[idx++] = row->chars[j];
+void editorUpdateRow(erow *row) {
+  editorUpdateRender(row);
+  editorUpdateSyntax(row);
+}
+
+/*
+ * Rows created in bulk are left ROW_STALE: their render and hl are built
+ * by editorRowFresh() when they are first drawn or searched, and a stale
+ * row's highlighting waits for the rows above it to be freshened first.
+ * The walk up stops a screen above the row; if stale rows go on from
+ * there, the row is drawn plain and the highlight worker is sent down
+ * from that point instead, which like a row below unloaded lines is
+ * taken to start outside any comment until the rows above are lexed.
+ */
+void editorRowFresh(erow *row) {
+  if (!(row->flags & ROW_STALE)) return;
+  erow *first = row, *prev;
+  int n = 0;
+  if (E.syntax)
+    while (n <= E.screenrows && (prev = rowPrev(first)) && !prev->run &&
+           (prev->flags & ROW_STALE)) {
+      first = prev;
+      n++;
     }
+  if (n > E.screenrows) {
+    editorUpdateRender(row);
+    free(row->hl);
+    row->hl = NULL;
+    row->hlgen++;
+    row->flags |= ROW_HL_NONE;
+    editorHlStaleMark(first);
+    return;
+  }
+  for (erow *r = first; ; r = rowNext(r)) {
+    editorUpdateRow(r);
+    if (r == row) break;
+  }
+}
+
+erow *editorNewRow() {
+  erow *row = calloc(1, sizeof(erow));
+  row->piececap = 1;
+  row->pieces = &row->piece;
+  return row;
+}
+
+/* Inserts n stale single-piece rows at 'at' with one split and merge of
+ * the line tree. Returns the last of them. */
+erow *editorInsertRows(int at, const epiece *lines, int n) {
+  if (at < 0 || at > E.numrows || n <= 0) return NULL;
+  erow **rows = malloc(sizeof(erow *) * n);
+  for (int i = 0; i < n; i++) {
+    rows[i] = editorNewRow();
+    editorRowInsertPiece(rows[i], 0, lines[i].s, lines[i].len);
+    rows[i]->size = lines[i].len;
+    rows[i]->flags = ROW_STALE;
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
+  erow *l, *r, *last = rows[n-1];
+  rowSplit(E.rows, at, &l, &r);
+  E.rows = rowMerge(rowMerge(l, rowBuild(rows, n)), r);
+  E.rows->parent = NULL;
+  free(rows);
+  if (at <= E.loadpos) E.loadpos += n;
+  E.numrows += n;
+  return last;
+}
 
-  editorUpdateSyntax(row);
+/* Turns lines [from, from+n) of a single run into rows. Returns the last. */
+erow *editorRowLoadRange(int from, int n) {
+  erow *l, *run, *r;
+  rowSplit(E.rows, from, &l, &r);
+  rowSplit(r, n, &run, &r);
+  E.rows = rowMerge(l, r);
+  if (E.rows) E.rows->parent = NULL;
+
+  epiece *lines = malloc(sizeof(epiece) * n);
+  for (int i = 0; i < n; i++) lines[i] = editorOrigLine(run->runfrom + i);
+  free(run);
+  E.numrows -= n;
+  int loadpos = E.loadpos;
+  erow *last = editorInsertRows(from, lines, n);
+  E.loadpos = loadpos;
+  free(lines);
+  return last;
 }
 
-int editorInsertRow(int at, char *s, size_t len, int auto_indent) {
+int editorInsertRow(int at, const epiece *pieces, int npieces, int auto_indent) {
   if (at < 0 || at > E.numrows) return 0;
 
-
+  erow *prev = at > 0 ? editorRowAt(at-1) : NULL;
   int indentlen = 0;
-  int indentsize = at > 0 ? E.row[at-1].size+1 : 0;
-  char indent_buf[indentsize];
-  if (auto_indent && indentsize) {
-    while (indentlen < indentsize && isspace(E.row[at-1].chars[indentlen])) {
-      indent_buf[indentlen] = E.row[at-1].chars[indentlen];
+  if (auto_indent && prev) {
+    while (indentlen < prev->size && isspace(editorRowCharAt(prev, indentlen)))
       indentlen++;
-    }
-    indent_buf[indentlen] = '\0';
   }
 
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(E.row + at + 1, E.row + at, sizeof(erow) * (E.numrows - at));
-  for (int i = at + 1; i <= E.numrows; ++i) E.row[i].idx++;
-  E.row[at].idx = at;
+  erow *row = editorNewRow();
 
-  E.row[at].size = len + indentlen;
-  E.row[at].chars = malloc(len + indentlen + 1);
-  if (auto_indent)
-    memcpy(E.row[at].chars, indent_buf, indentlen);
-  memcpy(E.row[at].chars + indentlen, s, len);
-  E.row[at].chars[len + indentlen] = '\0';
+  if (indentlen) {
+    epiece indent[prev->npieces];
+    int n = editorRowSlice(prev, 0, indentlen, indent);
+    for (int k = 0; k < n; k++)
+      editorRowInsertPiece(row, row->npieces, indent[k].s, indent[k].len);
+  }
+  for (int k = 0; k < npieces; k++)
+    editorRowInsertPiece(row, row->npieces, pieces[k].s, pieces[k].len);
+  row->size = indentlen;
+  for (int k = 0; k < npieces; k++) row->size += pieces[k].len;
 
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  E.row[at].hl_open_comment = 0;
-  editorUpdateRow(&E.row[at]);
+  editorRowTreeInsert(at, row);
+  editorUpdateRow(row);
+  editorJournal(J_INSERT_ROW, at, row->size, row->pieces, row->npieces);
 
   E.numrows++;
   E.dirty++;
@@ -540,64 +1972,167 @@ int editorInsertRow(int at, char *s, size_t len, int auto_indent) {
 }
 
 void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
+  if (row->gap) {
+    free(row->gap->buf);
+    free(row->gap);
+    if (E.hot == row) E.hot = NULL;
+  }
+  if (row->flags & ROW_RENDER_OWNED) free(row->render);
+  if (row->pieces != &row->piece) free(row->pieces);
   free(row->hl);
 }
 
 void editorDelRow(int at) {
   if (at < 0 || at >= E.numrows) return;
-  editorFreeRow(E.row + at);
-  memmove(E.row + at, E.row + at + 1, sizeof(erow) * (E.numrows - at - 1));
-  for (int i = at; i < E.numrows - 1; ++i) E.row[i].idx--;
+  editorJournal(J_DELETE_ROW, at, 0, NULL, 0);
+  erow *row = editorRowTreeRemove(at);
+  if (row->flags & ROW_HL_STALE) {
+    /* The pending pass picks up at the row that took its place. */
+    editorHlStaleDrop(row);
+    erow *next = at < E.numrows - 1 ? editorRowAt(at) : NULL;
+    if (next && !(next->flags & ROW_STALE)) editorHlStaleMark(next);
+  }
+  editorFreeRow(row);
+  free(row);
   E.numrows--;
   E.dirty++;
 }
 
+/* Shifts the mirrored render and hl of a tab-free hot row to open or close
+ * one byte at 'at', then re-highlights around the edit. */
+void editorRenderInsert(erow *row, int at, char c) {
+  memmove(row->render + at + 1, row->render + at, row->rsize - at);
+  row->render[at] = c;
+  if (row->hl) {
+    memmove(row->hl + at + 1, row->hl + at, row->rsize - at);
+    row->hl[at] = HL_NORMAL;
+  }
+  row->rsize++;
+  editorUpdateSyntaxSpan(row, at, at + 1);
+}
+
+void editorRenderDelete(erow *row, int at) {
+  memmove(row->render + at, row->render + at + 1, row->rsize - at - 1);
+  if (row->hl)
+    memmove(row->hl + at, row->hl + at + 1, row->rsize - at - 1);
+  row->rsize--;
+  editorUpdateSyntaxSpan(row, at, at);
+}
+
 void editorRowInsertChar(erow *row, int at, int c) {
   if (at < 0 || at > row->size) at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(row->chars + at + 1, row->chars + at, row->size - at + 1);
+  char ch = c;
+  epiece data = {&ch, 1};
+  editorJournal(J_INSERT_CHAR, editorRowIndex(row), at, &data, 1);
+  if (row->size >= KILO_GAP_MIN) editorRowHeat(row);
+  if (row->gap) {
+    int mirrored = row->gap->tabs == 0;
+    editorGapInsert(row, at, c);
+    row->size++;
+    if (mirrored && row->gap->tabs == 0)
+      editorRenderInsert(row, at, c);
+    else
+      editorUpdateRow(row);
+    E.dirty++;
+    return;
+  }
+
+  int off;
+  int k = editorRowFindPiece(row, at, &off);
+  /* Typing right after the last thing typed just grows that piece. */
+  if (off > 0 || k == 0 || !editorAddExtend(&row->pieces[k-1], ch)) {
+    const char *s = editorAddText(&ch, 1);
+    if (off > 0) {
+      epiece p = row->pieces[k];
+      row->pieces[k].len = off;
+      editorRowInsertPiece(row, k+1, p.s + off, p.len - off);
+      k++;
+    }
+    editorRowInsertPiece(row, k, s, 1);
+  }
   row->size++;
-  row->chars[at] = c;
   editorUpdateRow(row);
   E.dirty++;
 }
 
-void editorRowAppendString(erow *row, char* s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(row->chars + row->size, s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
+void editorRowAppendRow(erow *row, erow *from) {
+  editorJournal(J_APPEND_ROW, editorRowIndex(row), editorRowIndex(from), NULL, 0);
+  editorRowCool(row);
+  editorRowCool(from);
+  for (int k = 0; k < from->npieces; k++) {
+    editorRowInsertPiece(row, row->npieces, from->pieces[k].s,
+                         from->pieces[k].len);
+    row->size += from->pieces[k].len;
+  }
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+void editorRowTruncate(erow *row, int size) {
+  if (size < 0 || size >= row->size) return;
+  editorJournal(J_TRUNCATE, editorRowIndex(row), size, NULL, 0);
+  editorRowCool(row);
+  int off;
+  int k = editorRowFindPiece(row, size, &off);
+  row->pieces[k].len = off;
+  row->npieces = off ? k + 1 : k;
+  row->size = size;
   editorUpdateRow(row);
   E.dirty++;
 }
 
 void editorRowDelChar(erow *row, int at) {
   if (at < 0 || at >= row->size) return;
-  memmove(row->chars + at, row->chars + at + 1, row->size - at);
+  editorJournal(J_DELETE_CHAR, editorRowIndex(row), at, NULL, 0);
+  if (row->size >= KILO_GAP_MIN) editorRowHeat(row);
+  if (row->gap) {
+    int mirrored = row->gap->tabs == 0;
+    editorGapDelete(row, at);
+    row->size--;
+    if (mirrored && row->gap->tabs == 0)
+      editorRenderDelete(row, at);
+    else
+      editorUpdateRow(row);
+    E.dirty++;
+    return;
+  }
+
+  int off;
+  int k = editorRowFindPiece(row, at, &off);
+  epiece p = row->pieces[k];
+  if (off == 0) {
+    row->pieces[k].s++;
+    row->pieces[k].len--;
+  } else if (off == p.len - 1) {
+    row->pieces[k].len--;
+  } else {
+    row->pieces[k].len = off;
+    editorRowInsertPiece(row, k+1, p.s + off + 1, p.len - off - 1);
+  }
+  if (row->pieces[k].len == 0) editorRowRemovePiece(row, k);
   row->size--;
   editorUpdateRow(row);
   E.dirty++;
 }
 
+/* The two rows that swapped places are highlighted again from their new
+ * predecessors; a row whose entry state is unchanged comes from the
+ * cache. */
 void editorMoveRowUp(int at) {
   if (at <= 0 || at >= E.numrows) return;
-  E.row[at].idx--;
-  E.row[at-1].idx++;
-  erow temp = E.row[at-1];
-  E.row[at-1] = E.row[at];
-  E.row[at] = temp;
+  editorJournal(J_MOVE_UP, at, 0, NULL, 0);
+  editorRowTreeInsert(at-1, editorRowTreeRemove(at));
+  editorUpdateSyntax(editorRowAt(at-1));
+  editorUpdateSyntax(editorRowAt(at));
   E.dirty++;
 }
 
 void editorMoveRowDown(int at) {
   if (at < 0 || at >= E.numrows-1) return;
-  E.row[at].idx++;
-  E.row[at+1].idx--;
-  erow temp = E.row[at+1];
-  E.row[at+1] = E.row[at];
-  E.row[at] = temp;
+  editorJournal(J_MOVE_DOWN, at, 0, NULL, 0);
+  editorRowTreeInsert(at+1, editorRowTreeRemove(at));
+  editorUpdateSyntax(editorRowAt(at));
+  editorUpdateSyntax(editorRowAt(at+1));
   E.dirty++;
 }
 
@@ -606,23 +2141,22 @@ void editorMoveRowDown(int at) {
 
 void editorInsertChar(int c) {
   if (E.cy == E.numrows) {
-    editorInsertRow(E.numrows, "", 0, 0);
+    editorInsertRow(E.numrows, NULL, 0, 0);
   }
-  editorRowInsertChar(E.row + E.cy, E.cx, c);
+  editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
   E.cx++;
 }
 
 void editorInsertNewLine() {
   if(E.cx == 0) {
-    editorInsertRow(E.cy, "", 0, 1);
+    editorInsertRow(E.cy, NULL, 0, 1);
     E.cy++;
   } else {
-    erow *row = E.row+E.cy;
-    int prev_indented = editorInsertRow(E.cy+1, row->chars + E.cx, row->size - E.cx, 1);
-    row = E.row+E.cy;
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    erow *row = editorRowAt(E.cy);
+    epiece tail[row->npieces];
+    int n = editorRowSlice(row, E.cx, row->size, tail);
+    int prev_indented = editorInsertRow(E.cy+1, tail, n, 1);
+    editorRowTruncate(row, E.cx);
     E.cy++;
     E.cx = 0;
     if (prev_indented)
@@ -630,6 +2164,82 @@ void editorInsertNewLine() {
   }
 }
 
+/*
+ * Pasted text is copied into the add buffer once and split into lines
+ * there, with \r, \n and \r\n each ending a line. The first line joins
+ * the text before the cursor, the others become stale rows inserted with
+ * one split and merge of the line tree, and the text after the cursor
+ * moves to the end of the last of them. Nothing is auto-indented, and
+ * each row is highlighted once: the cursor row here, the new rows when
+ * they are first drawn. The journal records the result as the cursor
+ * row being replaced by the rows it became.
+ */
+void editorInsertBlock(const char *s, int len) {
+  if (len <= 0) return;
+  if (E.cy == E.numrows) editorInsertRow(E.numrows, NULL, 0, 0);
+  erow *row = editorRowAt(E.cy);
+  editorRowCool(row);
+  const char *text = editorAddText(s, len);
+
+  int n = 1;
+  for (int i = 0; i < len; i++)
+    if (text[i] == '\r' || (text[i] == '\n' && (i == 0 || text[i-1] != '\r')))
+      n++;
+  epiece *lines = malloc(sizeof(epiece) * n);
+  const char *start = text;
+  n = 0;
+  for (int i = 0; i < len; i++) {
+    if (text[i] != '\r' && text[i] != '\n') continue;
+    if (text[i] == '\r' || i == 0 || text[i-1] != '\r') {
+      lines[n].s = start;
+      lines[n++].len = text + i - start;
+    }
+    start = text + i + 1;
+  }
+  lines[n].s = start;
+  lines[n++].len = text + len - start;
+
+  epiece tail[row->npieces + 1];
+  int ntail = editorRowSlice(row, E.cx, row->size, tail);
+  int off;
+  int k = editorRowFindPiece(row, E.cx, &off);
+  row->npieces = k;
+  if (off) row->pieces[row->npieces++].len = off;
+  row->size = E.cx;
+  editorRowInsertPiece(row, row->npieces, lines[0].s, lines[0].len);
+  row->size += lines[0].len;
+
+  erow *last = row;
+  if (n > 1) {
+    E.rowsgen++;
+    last = editorInsertRows(E.cy + 1, lines + 1, n - 1);
+  }
+  E.cx = last->size;
+  for (k = 0; k < ntail; k++) {
+    editorRowInsertPiece(last, last->npieces, tail[k].s, tail[k].len);
+    last->size += tail[k].len;
+  }
+  /* A stale row has a single piece, which is all the highlight worker
+   * renders, so the last row is built now that it has the tail too. */
+  editorUpdateRow(row);
+  if (last != row && ntail) editorUpdateRow(last);
+  /* Propagation stops at the new rows, so the row below them, lexed from
+   * the state the cursor row used to end in, gets a pass of its own. */
+  erow *next = rowNext(last);
+  if (last != row && next && !next->run && !(next->flags & ROW_STALE))
+    editorHlStaleMark(next);
+
+  if (E.journal.fd != -1) {
+    editorJournal(J_DELETE_ROW, E.cy, 0, NULL, 0);
+    erow *r = row;
+    for (int i = 0; i < n; i++, r = rowNext(r))
+      editorJournal(J_INSERT_ROW, E.cy + i, r->size, r->pieces, r->npieces);
+  }
+  E.cy += n - 1;
+  E.dirty++;
+  free(lines);
+}
+
 void editorDelChar() {
   if (E.cy == E.numrows) {
     editorMoveCursor(ARROW_LEFT);
@@ -637,13 +2247,14 @@ void editorDelChar() {
   }
   if (E.cx == 0 && E.cy == 0) return;
 
-  erow *row = E.row + E.cy;
+  erow *row = editorRowAt(E.cy);
   if (E.cx > 0) {
     editorRowDelChar(row, E.cx - 1);
     E.cx--;
   } else {
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+    erow *prev = editorRowPrev(row);
+    E.cx = prev->size;
+    editorRowAppendRow(prev, row);
     editorDelRow(E.cy);
     E.cy--;
   }
@@ -688,27 +2299,241 @@ void editorDuplicateLine() {
   E.cx = 0;
   editorInsertNewLine();
   E.cx = curr_cx;
-  editorRowAppendString(E.row + E.cy - 1, E.row[E.cy].chars, E.row[E.cy].size);
+  erow *row = editorRowAt(E.cy);
+  editorRowAppendRow(editorRowPrev(row), row);
 }
 
 /*** file i/o ***/
 
-char* editorRowsToString(int *buflen) {
-  int totlen = 0;
-  for (int i = 0; i < E.numrows; ++i)
-    totlen += E.row[i].size + 1; // waring: \n char
-  *buflen = totlen;
+/*
+ * Line starts of the opened file are found by comparing 16 or 32 bytes at
+ * a time against '\n' and walking the resulting bit mask, falling back to
+ * memchr() for the tail and on other architectures. Only the starts are
+ * recorded; a trailing '\r' is trimmed when a line becomes a row.
+ */
+
+void lineIndexGrow(struct lineindex *li, size_t need) {
+  if (li->n + need <= li->cap) return;
+  while (li->n + need > li->cap) li->cap = li->cap ? li->cap * 2 : 1024;
+  li->off = realloc(li->off, sizeof(size_t) * li->cap);
+}
+
+/* Appends the offset just past every '\n' in s[from, to) to li. */
+void lineScanScalar(const char *s, size_t from, size_t to,
+                    struct lineindex *li) {
+  while (from < to) {
+    const char *nl = memchr(s + from, '\n', to - from);
+    if (!nl) break;
+    from = nl - s + 1;
+    lineIndexGrow(li, 1);
+    li->off[li->n++] = from;
+  }
+}
+
+#if defined(__x86_64__)
+void lineScanSSE2(const char *s, size_t from, size_t to,
+                  struct lineindex *li) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  for (; from + 16 <= to; from += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + from));
+    unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+    if (!mask) continue;
+    lineIndexGrow(li, 16);
+    while (mask) {
+      li->off[li->n++] = from + __builtin_ctz(mask) + 1;
+      mask &= mask - 1;
+    }
+  }
+  lineScanScalar(s, from, to, li);
+}
+
+__attribute__((target("avx2")))
+void lineScanAVX2(const char *s, size_t from, size_t to,
+                  struct lineindex *li) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  for (; from + 32 <= to; from += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + from));
+    unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+    if (!mask) continue;
+    lineIndexGrow(li, 32);
+    while (mask) {
+      li->off[li->n++] = from + __builtin_ctz(mask) + 1;
+      mask &= mask - 1;
+    }
+  }
+  lineScanScalar(s, from, to, li);
+}
+#endif
+
+void editorScanLines(const char *s, size_t from, size_t to,
+                     struct lineindex *li) {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2"))
+    lineScanAVX2(s, from, to, li);
+  else
+    lineScanSSE2(s, from, to, li);
+#else
+  lineScanScalar(s, from, to, li);
+#endif
+}
+
+/*
+ * Large files are indexed in parallel: each thread scans one slice into its
+ * own index, and the slices are then copied one after the other into the
+ * final index. KILO_THREADS in the environment sets the number of threads
+ * (default: one per online CPU); with one thread everything is scanned
+ * in place.
+ */
+
+struct scanjob {
+  const char *s;
+  size_t from;
+  size_t to;
+  struct lineindex li;
+};
+
+void *lineScanWorker(void *arg) {
+  struct scanjob *job = arg;
+  editorScanLines(job->s, job->from, job->to, &job->li);
+  return NULL;
+}
+
+int editorThreads() {
+  char *env = getenv("KILO_THREADS");
+  long n = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+  return n < 1 ? 1 : n;
+}
+
+void editorIndexLines(const char *s, size_t from, size_t to,
+                      struct lineindex *li) {
+  size_t len = to - from;
+  size_t nthreads = editorThreads();
+  if (len / KILO_INDEX_CHUNK_MIN < nthreads)
+    nthreads = len / KILO_INDEX_CHUNK_MIN;
+  if (nthreads <= 1) {
+    editorScanLines(s, from, to, li);
+    return;
+  }
+
+  struct scanjob jobs[nthreads];
+  pthread_t tids[nthreads];
+  int started[nthreads];
+  size_t i;
+  for (i = 0; i < nthreads; i++) {
+    jobs[i].s = s;
+    jobs[i].from = from + len / nthreads * i;
+    jobs[i].to = (i == nthreads - 1) ? to : from + len / nthreads * (i + 1);
+    jobs[i].li.off = NULL;
+    jobs[i].li.n = jobs[i].li.cap = 0;
+  }
+  for (i = 1; i < nthreads; i++)
+    started[i] = pthread_create(&tids[i], NULL, lineScanWorker, &jobs[i]) == 0;
+  lineScanWorker(&jobs[0]);
+  for (i = 1; i < nthreads; i++) {
+    if (started[i]) pthread_join(tids[i], NULL);
+    else lineScanWorker(&jobs[i]);
+  }
+
+  size_t total = 0;
+  for (i = 0; i < nthreads; i++) total += jobs[i].li.n;
+  lineIndexGrow(li, total);
+  for (i = 0; i < nthreads; i++) {
+    memcpy(li->off + li->n, jobs[i].li.off, sizeof(size_t) * jobs[i].li.n);
+    li->n += jobs[i].li.n;
+    free(jobs[i].li.off);
+  }
+}
+
+/*
+ * Files larger than one KILO_LOAD_BLOCK are indexed by a loader thread
+ * after the first block, so the first screen does not wait for the rest.
+ * The loader hands each indexed block over under a lock; the main thread
+ * picks them up while waiting for input and adds the new lines as a run
+ * at E.loadpos, the row just past the part of the file loaded so far.
+ */
+
+void *editorLoadWorker(void *arg) {
+  (void)arg;
+  size_t from = E.load.scanned;
+  while (from < E.origlen) {
+    size_t to = from + KILO_LOAD_BLOCK;
+    if (to > E.origlen) to = E.origlen;
+    struct lineindex li = {NULL, 0, 0};
+    editorIndexLines(E.orig, from, to, &li);
+
+    pthread_mutex_lock(&E.load.lock);
+    lineIndexGrow(&E.load.pending, li.n);
+    memcpy(E.load.pending.off + E.load.pending.n, li.off,
+           sizeof(size_t) * li.n);
+    E.load.pending.n += li.n;
+    E.load.scanned = to;
+    pthread_mutex_unlock(&E.load.lock);
+    free(li.off);
+    from = to;
+  }
+  pthread_mutex_lock(&E.load.lock);
+  E.load.done = 1;
+  pthread_mutex_unlock(&E.load.lock);
+  return NULL;
+}
+
+/* The offset past the last line ending (real, or assumed when the file
+ * lacks one) ends the index. */
+void editorIndexEnd() {
+  if (E.origlen && E.orig[E.origlen - 1] != '\n') {
+    lineIndexGrow(&E.lines, 1);
+    E.lines.off[E.lines.n++] = E.origlen + 1;
+  }
+}
+
+/* Adds the lines indexed since the last call to the line tree. */
+void editorLoadPublish() {
+  int n = E.lines.n - 1 - E.loadlines;
+  if (n <= 0) return;
+  erow *l, *r;
+  rowSplit(E.rows, E.loadpos, &l, &r);
+  E.rows = rowMerge(rowMerge(l, rowNewRun(E.loadlines, n)), r);
+  E.rows->parent = NULL;
+  E.loadlines += n;
+  E.loadpos += n;
+  E.numrows += n;
+}
 
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (int i = 0; i < E.numrows; ++i)
-  {
-    memcpy(p, E.row[i].chars, E.row[i].size);
-    p += E.row[i].size;
-    *p = '\n';
-    p++;
+/* Collects what the loader has indexed, waiting for all of it when 'wait'
+ * is set. Returns whether anything changed. */
+int editorLoadPoll(int wait) {
+  if (!E.load.active) return 0;
+  if (wait) pthread_join(E.load.tid, NULL);
+
+  pthread_mutex_lock(&E.load.lock);
+  struct lineindex got = E.load.pending;
+  E.load.pending.off = NULL;
+  E.load.pending.n = E.load.pending.cap = 0;
+  int done = E.load.done;
+  E.load.seen = E.load.scanned;
+  pthread_mutex_unlock(&E.load.lock);
+
+  lineIndexGrow(&E.lines, got.n);
+  memcpy(E.lines.off + E.lines.n, got.off, sizeof(size_t) * got.n);
+  E.lines.n += got.n;
+  free(got.off);
+  if (done) {
+    if (!wait) pthread_join(E.load.tid, NULL);
+    editorIndexEnd();
+    E.load.active = 0;
   }
-  return buf;
+  editorLoadPublish();
+  return got.n > 0 || done;
+}
+
+/* Returns line i of the opened file, without its line ending. */
+epiece editorOrigLine(int i) {
+  size_t start = E.lines.off[i];
+  size_t end = E.lines.off[i + 1] - 1;
+  while (end > start && E.orig[end - 1] == '\r')
+    end--;
+  epiece line = {E.orig + start, end - start};
+  return line;
 }
 
 void editorOpen(char *filename) {
@@ -717,23 +2542,372 @@ void editorOpen(char *filename) {
 
   editorSelectSyntaxHighlight();
 
-  FILE *fp = fopen(filename, "r");
-  if (!fp) die("fopen");
-
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                           line[linelen - 1] == '\r'))
-      linelen--;
-    editorInsertRow(E.numrows, line, linelen, 0);
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) die("open");
+
+  /* Regular files are mapped rather than read, so opening one costs only
+   * the scan for line starts below. */
+  struct stat st;
+  E.orig = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    E.orig = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (E.orig != MAP_FAILED) {
+    E.origlen = st.st_size;
+    E.mapped = 1;
+  } else {
+    size_t cap = 64 * 1024;
+    E.orig = malloc(cap);
+    E.origlen = 0;
+    ssize_t nread;
+    while ((nread = read(fd, E.orig + E.origlen, cap - E.origlen)) > 0) {
+      E.origlen += nread;
+      if (E.origlen == cap) {
+        cap *= 2;
+        E.orig = realloc(E.orig, cap);
+      }
+    }
+    if (nread == -1) die("read");
+  }
+  close(fd);
+
+  /* Every line starts at 0 or just past a '\n'. */
+  lineIndexGrow(&E.lines, 1);
+  E.lines.off[E.lines.n++] = 0;
+  E.loadlines = 0;
+  E.loadpos = E.numrows;
+
+  size_t first = E.mapped && E.origlen > KILO_LOAD_BLOCK ?
+    KILO_LOAD_BLOCK : E.origlen;
+  editorIndexLines(E.orig, 0, first, &E.lines);
+  if (first < E.origlen) {
+    E.load.scanned = first;
+    E.load.done = 0;
+    E.load.seen = first;
+    pthread_mutex_init(&E.load.lock, NULL);
+    if (pthread_create(&E.load.tid, NULL, editorLoadWorker, NULL) == 0)
+      E.load.active = 1;
+    else
+      editorIndexLines(E.orig, first, E.origlen, &E.lines);
   }
-  free(line);
-  fclose(fp);
+  if (!E.load.active) editorIndexEnd();
+  editorLoadPublish();
   E.dirty = 0;
 }
 
+/* Applies the records in p[0, n), counting them in *count, and returns
+ * the offset just past the last one applied. Anything after it is a
+ * record torn by a crash. */
+size_t editorJournalReplay(const char *p, size_t n, int *count) {
+  size_t i = 0, done = 0;
+  *count = 0;
+  while (i + JOURNAL_RECORD <= n) {
+    int op = p[i];
+    int32_t row, arg;
+    memcpy(&row, p + i + 1, 4);
+    memcpy(&arg, p + i + 5, 4);
+    i += JOURNAL_RECORD;
+    size_t len = op == J_INSERT_ROW ? (size_t)arg : op == J_INSERT_CHAR;
+    if (arg < 0 || i + len > n) break;
+
+    erow *r = (row >= 0 && row < E.numrows) ? editorRowAt(row) : NULL;
+    switch (op) {
+      case J_INSERT_ROW: {
+        epiece line = {editorAddText(p + i, len), len};
+        editorInsertRow(row, &line, len ? 1 : 0, 0);
+        break;
+      }
+      case J_DELETE_ROW: editorDelRow(row); break;
+      case J_INSERT_CHAR: if (r) editorRowInsertChar(r, arg, p[i]); break;
+      case J_DELETE_CHAR: if (r) editorRowDelChar(r, arg); break;
+      case J_APPEND_ROW:
+        if (r && arg < E.numrows && arg != row)
+          editorRowAppendRow(r, editorRowAt(arg));
+        break;
+      case J_TRUNCATE: if (r) editorRowTruncate(r, arg); break;
+      case J_MOVE_UP: editorMoveRowUp(row); break;
+      case J_MOVE_DOWN: editorMoveRowDown(row); break;
+      default: return done;
+    }
+    i += len;
+    done = i;
+    (*count)++;
+  }
+  return done;
+}
+
+/* Starts the journal over, with a header for the file as it is on disk
+ * and the records from 'keep' on. */
+void editorJournalReset(off_t keep) {
+  struct journal *j = &E.journal;
+  struct jheader h;
+  struct stat st;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, "KILOJRN1", 8);
+  if (stat(E.filename, &st) == 0) {
+    h.size = st.st_size;
+    h.sec = st.st_mtim.tv_sec;
+    h.nsec = st.st_mtim.tv_nsec;
+  }
+
+  editorJournalFlush(1);
+  /* Records still buffered after a failed write come after those in the
+   * file; the ones the save covered go the same way as theirs. */
+  if (keep > j->size) {
+    size_t drop = (size_t)(keep - j->size);
+    if (drop > j->len) drop = j->len;
+    memmove(j->buf, j->buf + drop, j->len - drop);
+    j->len -= drop;
+  }
+  size_t n = keep < j->size ? j->size - keep : 0;
+  char *tail = malloc(n ? n : 1);
+  if (n && pread(j->fd, tail, n, keep) != (ssize_t)n) n = 0;
+  if (ftruncate(j->fd, 0) == 0 &&
+      pwrite(j->fd, &h, sizeof(h), 0) == sizeof(h) &&
+      (n == 0 || pwrite(j->fd, tail, n, sizeof(h)) == (ssize_t)n))
+    j->size = sizeof(h) + n;
+  free(tail);
+  pthread_mutex_lock(&j->lock);
+  j->unsynced = 1;
+  pthread_cond_signal(&j->wake);
+  pthread_mutex_unlock(&j->lock);
+}
+
+/* Opens the journal of E.filename, replaying it first when it was left
+ * behind for the file as it is on disk. */
+void editorJournalOpen() {
+  struct journal *j = &E.journal;
+  char *slash = strrchr(E.filename, '/');
+  int dirlen = slash ? slash - E.filename + 1 : 0;
+  size_t len = strlen(E.filename) + 11;
+  free(j->path);
+  j->path = malloc(len);
+  snprintf(j->path, len, "%.*s.%s.kjournal", dirlen, E.filename,
+    E.filename + dirlen);
+
+  j->fd = open(j->path, O_RDWR | O_CREAT, 0600);
+  if (j->fd == -1) return;
+  if (!j->syncing)
+    j->syncing = pthread_create(&j->syncer, NULL, editorJournalSyncer, j) == 0;
+
+  struct stat st, fst;
+  struct jheader h;
+  int count = 0;
+  if (fstat(j->fd, &st) == 0 && st.st_size > (off_t)sizeof(h) &&
+      pread(j->fd, &h, sizeof(h), 0) == sizeof(h) &&
+      !memcmp(h.magic, "KILOJRN1", 8) && stat(E.filename, &fst) == 0 &&
+      h.size == fst.st_size && h.sec == fst.st_mtim.tv_sec &&
+      h.nsec == fst.st_mtim.tv_nsec) {
+    size_t n = st.st_size - sizeof(h);
+    char *p = malloc(n);
+    j->size = st.st_size;
+    if (pread(j->fd, p, n, sizeof(h)) == (ssize_t)n) {
+      editorLoadPoll(1);
+      j->replaying = 1;
+      n = editorJournalReplay(p, n, &count);
+      j->replaying = 0;
+      /* New records go right after the last whole one. */
+      j->size = sizeof(h) + n;
+      if (j->size < st.st_size && ftruncate(j->fd, j->size) == -1)
+        j->size = st.st_size;
+    }
+    free(p);
+  }
+  if (count)
+    editorSetStatusMessage("Recovered %d edits from %s", count, j->path);
+  else
+    editorJournalReset(j->size);
+}
+
+void editorJournalClose() {
+  if (E.journal.fd == -1) return;
+  unlink(E.journal.path);
+}
+
+/*
+ * Saving happens on a worker thread so that typing can go on meanwhile.
+ * editorSave takes a snapshot of the buffer as a list of pieces, with
+ * unmaterialized runs as line ranges of the original file; all of those
+ * point into storage that is never modified (the hot row is cooled
+ * first), so the worker needs no locking to read them. The main thread
+ * picks up the result while waiting for input.
+ *
+ * The worker writes the pieces with writev(), batching KILO_SAVE_IOV of
+ * them per call. A piece that ends just before a '\n' of the original file
+ * is extended over it, and pieces that touch are joined, so an unedited
+ * stretch of an LF file goes out as one iovec. The data goes to a
+ * temporary file that is synced and then renamed over the original, which
+ * also leaves the mapping of the old file intact for the rows that still
+ * point into it.
+ */
+
+struct savebuf {
+  struct iovec iov[KILO_SAVE_IOV];
+  int n;
+  int fd;
+  size_t written;
+  int failed;
+};
+
+void saveFlush(struct savebuf *sb) {
+  struct iovec *iov = sb->iov;
+  int n = sb->n;
+  sb->n = 0;
+  while (n > 0 && !sb->failed) {
+    ssize_t w = writev(sb->fd, iov, n);
+    if (w == -1) {
+      if (errno != EINTR) sb->failed = 1;
+      continue;
+    }
+    sb->written += w;
+    while (n > 0 && (size_t)w >= iov->iov_len) {
+      w -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+}
+
+void saveAdd(struct savebuf *sb, const char *s, size_t len) {
+  if (len == 0) return;
+  if (sb->n) {
+    struct iovec *last = &sb->iov[sb->n - 1];
+    if ((char *)last->iov_base + last->iov_len == s) {
+      last->iov_len += len;
+      return;
+    }
+  }
+  if (sb->n == KILO_SAVE_IOV) saveFlush(sb);
+  sb->iov[sb->n].iov_base = (void *)s;
+  sb->iov[sb->n].iov_len = len;
+  sb->n++;
+}
+
+void saveNewline(struct savebuf *sb, const char *after) {
+  if (after && after >= E.orig && after < E.orig + E.origlen && *after == '\n')
+    saveAdd(sb, after, 1);
+  else
+    saveAdd(sb, "\n", 1);
+}
+
+void saveAddItem(struct savebuf *sb, struct saveitem *it, const char **end) {
+  if (it->s == NULL) {
+    for (int i = it->from; i < it->from + it->len; i++) {
+      epiece line = editorOrigLine(i);
+      saveAdd(sb, line.s, line.len);
+      saveNewline(sb, line.s + line.len);
+    }
+    return;
+  }
+  saveAdd(sb, it->s, it->len);
+  if (it->len) *end = it->s + it->len;
+  if (it->eol) {
+    saveNewline(sb, *end);
+    *end = NULL;
+  }
+}
+
+void *editorSaveWorker(void *arg) {
+  struct saver *job = arg;
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  struct stat st;
+  mode_t mode;
+  if (stat(job->filename, &st) == 0) {
+    mode = st.st_mode & 07777;
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    mode = 0644 & ~mask;
+  }
+
+  size_t tmplen = strlen(job->filename) + 12;
+  char tmpname[tmplen];
+  snprintf(tmpname, tmplen, "%s.kiloXXXXXX", job->filename);
+  struct savebuf *sb = malloc(sizeof(struct savebuf));
+  sb->n = 0;
+  sb->written = 0;
+  sb->failed = 0;
+  sb->fd = mkstemp(tmpname);
+  int err = errno;
+  if (sb->fd != -1) {
+    const char *end = NULL;
+    for (int i = 0; i < job->nitems; i++) saveAddItem(sb, &job->items[i], &end);
+    saveFlush(sb);
+    int ok = !sb->failed && fchmod(sb->fd, mode) == 0 && fsync(sb->fd) == 0;
+    err = errno;
+    if (close(sb->fd) == -1 && ok) {
+      ok = 0;
+      err = errno;
+    }
+    if (ok && rename(tmpname, job->filename) == 0) {
+      err = 0;
+    } else {
+      if (ok) err = errno;
+      unlink(tmpname);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  pthread_mutex_lock(&job->lock);
+  job->written = sb->written;
+  job->secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  job->err = err;
+  job->done = 1;
+  pthread_mutex_unlock(&job->lock);
+  free(sb);
+  return NULL;
+}
+
+/* Reports a finished save, waiting for it when 'wait' is set. Returns
+ * whether one finished. */
+int editorSavePoll(int wait) {
+  struct saver *job = &E.save;
+  if (!job->active) return 0;
+  pthread_mutex_lock(&job->lock);
+  int done = job->done;
+  pthread_mutex_unlock(&job->lock);
+  if (!done && !wait) return 0;
+
+  pthread_join(job->tid, NULL);
+  job->active = 0;
+  free(job->items);
+  free(job->filename);
+  if (job->err == 0) {
+    /* Edits made while the save ran are still unsaved. */
+    E.dirty -= job->dirty;
+    if (E.journal.fd == -1) editorJournalOpen();
+    else editorJournalReset(job->journal_at);
+    editorSetStatusMessage("%zu bytes written to disk in %.2fs (%.0f MB/s)",
+      job->written, job->secs,
+      job->secs > 0 ? job->written / job->secs / 1e6 : 0.0);
+  } else {
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(job->err));
+  }
+  return 1;
+}
+
+void editorIdle() {
+  int changed = editorLoadPoll(0);
+  if (editorSavePoll(0)) changed = 1;
+  if (editorHighlightPoll(0)) changed = 1;
+  if (E.shadow.plain && !editorHlPendingAbove(E.rowoff)) changed = 1;
+  editorJournalFlush(1);
+  if (changed) editorRefreshScreen();
+}
+
+void editorSaveAppend(struct saveitem it, int *cap) {
+  if (E.save.nitems == *cap) {
+    *cap *= 2;
+    E.save.items = realloc(E.save.items, sizeof(struct saveitem) * *cap);
+  }
+  E.save.items[E.save.nitems++] = it;
+}
+
 void editorSave() {
   if (E.filename == NULL) {
     E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
@@ -744,25 +2918,47 @@ void editorSave() {
     editorSelectSyntaxHighlight();
   }
 
-  int len;
-  char *buf = editorRowsToString(&len);
-
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
-      }
+  editorSavePoll(1);
+  editorLoadPoll(1);
+  if (E.hot) editorRowCool(E.hot);
+
+  struct saver *job = &E.save;
+  int cap = 1024;
+  job->items = malloc(sizeof(struct saveitem) * cap);
+  job->nitems = 0;
+  for (erow *row = rowFirst(E.rows); row; row = rowNext(row)) {
+    struct saveitem it = {NULL, 0, 0, 0};
+    if (row->run) {
+      it.len = row->run;
+      it.from = row->runfrom;
+      editorSaveAppend(it, &cap);
+      continue;
+    }
+    for (int k = 0; k < row->npieces; k++) {
+      it.s = row->pieces[k].s;
+      it.len = row->pieces[k].len;
+      it.eol = (k == row->npieces - 1);
+      editorSaveAppend(it, &cap);
+    }
+    if (row->npieces == 0) {
+      it.s = "";
+      it.eol = 1;
+      editorSaveAppend(it, &cap);
     }
-    close(fd);
   }
-
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+  job->filename = strdup(E.filename);
+  job->dirty = E.dirty;
+  job->journal_at = E.journal.size + E.journal.len;
+  job->done = 0;
+
+  if (pthread_create(&job->tid, NULL, editorSaveWorker, job) != 0) {
+    free(job->items);
+    free(job->filename);
+    editorSetStatusMessage("Can't save! %s", strerror(errno));
+    return;
+  }
+  job->active = 1;
+  editorSetStatusMessage("Saving...");
 }
 
 /*** find ***/
@@ -771,12 +2967,12 @@ void editorFindCallback(char* query, int key) {
   static int last_match = -1;
   static int direction = 1;
 
-  static int saved_hl_line;
-  static unsigned char *saved_hl = NULL;
-  if (saved_hl) {
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
+  /* The row with the match shown is highlighted again rather than given
+   * back its old hl, which the worker may have replaced meanwhile. */
+  static int match_line = -1;
+  if (match_line != -1) {
+    if (match_line < E.numrows) editorUpdateSyntax(editorRowAt(match_line));
+    match_line = -1;
   }
 
   if (key == '\r' || key == '\x1b') {
@@ -794,23 +2990,26 @@ void editorFindCallback(char* query, int key) {
 
   if (last_match == -1) direction = 1;
   int current = last_match;
+  erow *row = NULL;
   int i;
   for (i = 0; i < E.numrows; i++) {
     current += direction;
     if (current == -1) current = E.numrows-1;
     else if (current == E.numrows) current = 0;
 
-    erow *row = &E.row[current];
-    char *match = strstr(row->render, query);
+    if (row) row = (direction == 1) ? editorRowNext(row) : editorRowPrev(row);
+    if (!row) row = editorRowAt(current);
+    editorRowFresh(row);
+    char *match = memmem(row->render, row->rsize, query, strlen(query));
     if (match) {
       last_match = current;
       E.cy = current;
       E.cx = editorRowRxToCx(row, match - row->render);
       E.rowoff = E.numrows;
 
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
+      match_line = current;
+      if (!row->hl) row->hl = calloc(editorRowRenderCap(row), 1);
+      row->hlgen++;
       memset(row->hl + (match - row->render), HL_MATCH, strlen(query));
       break;
     }
@@ -837,24 +3036,39 @@ void editorFind() {
 
 /*** append buffer ***/
 
+/*
+ * The buffers a frame is built in live as long as the editor and are only
+ * emptied between frames, so once they have grown to fit a screenful a
+ * frame allocates nothing. They grow by doubling.
+ */
 struct abuf {
   char *b;
   int len;
+  int cap;
 };
 
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
 
-void abAppend(struct abuf *ab, const char *s, int len) {
-  char *new = realloc(ab->b, ab->len + len);
+int abGrow(struct abuf *ab, int need) {
+  int cap = ab->cap ? ab->cap : 4096;
+  while (cap < need) cap *= 2;
+  char *new = realloc(ab->b, cap);
 
-  if (new == NULL) return;
-  memcpy(&new[ab->len], s, len);
+  if (new == NULL) return 0;
   ab->b = new;
+  ab->cap = cap;
+  return 1;
+}
+
+void abAppend(struct abuf *ab, const char *s, int len) {
+  if (ab->len + len > ab->cap && !abGrow(ab, ab->len + len)) return;
+  memcpy(&ab->b[ab->len], s, len);
   ab->len += len;
 }
 
-void abFree(struct abuf *ab) {
-  free(ab->b);
+static inline void abPutc(struct abuf *ab, char c) {
+  if (ab->len == ab->cap && !abGrow(ab, ab->len + 1)) return;
+  ab->b[ab->len++] = c;
 }
 
 /*** output ***/
@@ -862,7 +3076,7 @@ void abFree(struct abuf *ab) {
 void editorScroll() {
   E.rx = 0;
   if (E.cy < E.numrows) {
-    E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
   }
   if (E.cy < E.rowoff) {
     E.rowoff = E.cy;
@@ -878,7 +3092,60 @@ void editorScroll() {
   }
 }
 
-void editorDrawRows(struct abuf *ab) {
+/*
+ * Every frame builds each terminal line afresh, but only lines that differ
+ * from what E.shadow says was last sent for them are written, each after
+ * an escape that moves the cursor to its start. Lines end by clearing to
+ * the end of the line and leave the default colours set, so one can be
+ * redrawn without touching its neighbours.
+ */
+void editorScreenLine(struct abuf *out, int y, struct abuf *line) {
+  struct screenline *old = &E.shadow.lines[y];
+  if (old->len == line->len && !memcmp(old->b, line->b, line->len)) return;
+
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1);
+  abAppend(out, buf, len);
+  abAppend(out, line->b, line->len);
+
+  if (line->len > old->cap) {
+    old->cap = old->cap ? old->cap : 64;
+    while (old->cap < line->len) old->cap *= 2;
+    old->b = realloc(old->b, old->cap);
+  }
+  memcpy(old->b, line->b, line->len);
+  old->len = line->len;
+}
+
+/* Moves the text lines of the terminal, and of E.shadow with them, up by
+ * n lines or down for negative n, inside a scroll region that spares the
+ * two bars. The lines this exposes are blank and are drawn like any other
+ * line that changed. */
+void editorScreenScroll(struct abuf *out, int n) {
+  struct screenline *l = E.shadow.lines;
+  int rows = E.screenrows;
+  int k = abs(n);
+  struct screenline tmp[k];
+
+  char buf[48];
+  int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r", rows, k,
+                     n > 0 ? 'S' : 'T');
+  abAppend(out, buf, len);
+
+  if (n > 0) {
+    memcpy(tmp, l, sizeof(*l) * k);
+    memmove(l, l + k, sizeof(*l) * (rows - k));
+    memcpy(l + rows - k, tmp, sizeof(*l) * k);
+    for (int y = rows - k; y < rows; y++) l[y].len = -1;
+  } else {
+    memcpy(tmp, l + rows - k, sizeof(*l) * k);
+    memmove(l + k, l, sizeof(*l) * (rows - k));
+    memcpy(l, tmp, sizeof(*l) * k);
+    for (int y = 0; y < k; y++) l[y].len = -1;
+  }
+}
+
+void editorDrawRows(struct abuf *out, struct abuf *line) {
   int y;
   // add line number
   int digitnum = (int)ceil(log10(E.numrows));
@@ -887,8 +3154,14 @@ void editorDrawRows(struct abuf *ab) {
   snprintf(line_num_format_buf, 32, "%%0%dd" KILO_LINE_NUM_SEP, digitnum);
   E.rowborder_width = digitnum + strlen(KILO_LINE_NUM_SEP);
 
+  const struct hlcolor *colors = editorHlColors();
+  /* Until the worker is through a pass that starts above the screen, the
+   * rows on it are drawn plain rather than in stale colours. */
+  E.shadow.plain = E.syntax && editorHlPendingAbove(E.rowoff);
+  erow *row = editorRowAt(E.rowoff);
   for (y = 0; y < E.screenrows; y++) {
     int filerow = y + E.rowoff;
+    line->len = 0;
     if (filerow >= E.numrows) {
       if (E.numrows == 0 && y == E.screenrows / 3) {
         char welcome[80];
@@ -897,72 +3170,78 @@ void editorDrawRows(struct abuf *ab) {
         if (welcomelen > E.screencols) welcomelen = E.screencols;
         int padding = (E.screencols - welcomelen) / 2;
         if (padding) {
-          abAppend(ab, "~", 1);
+          abPutc(line, '~');
           padding--;
         }
-        while (padding--) abAppend(ab, " ", 1);
-        abAppend(ab, welcome, welcomelen);
+        while (padding--) abPutc(line, ' ');
+        abAppend(line, welcome, welcomelen);
       } else {
-        abAppend(ab, "~", 1);
+        abPutc(line, '~');
       }
     } else {
       char line_num_buf[E.rowborder_width+1];
-      snprintf(line_num_buf, E.rowborder_width+1, line_num_format_buf, E.row[filerow].idx);
+      snprintf(line_num_buf, E.rowborder_width+1, line_num_format_buf, filerow);
+
+      abAppend(line, "\x1b[94m", 5);
+      abAppend(line, line_num_buf, E.rowborder_width+1);
+      abAppend(line, "\x1b[m", 3);
 
-      abAppend(ab, "\x1b[94m", 5);
-      abAppend(ab, line_num_buf, E.rowborder_width+1);
-      abAppend(ab, "\x1b[m", 3);
-      
-      int len = E.row[filerow].rsize - E.coloff;
+      editorRowFresh(row);
+      int len = row->rsize - E.coloff;
       if (len < 0) len = 0;
       if (len > E.screencols - E.rowborder_width) len = E.screencols - E.rowborder_width;
-      char *c = &E.row[filerow].render[E.coloff];
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
-      int current_color = -1;
-      for (int j = 0; j < len; ++j)
-      {
+      char *c = &row->render[E.coloff];
+      unsigned char *hl = NULL;
+      if (row->hl && !E.shadow.plain) hl = &row->hl[E.coloff];
+      const struct hlcolor *cur = &colors[HL_NORMAL];
+      int j = 0;
+      while (j < len) {
         if (iscntrl(c[j])) {
           char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
-          if (current_color != -1) {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            abAppend(ab, buf, clen);
-          }
-        } else if (hl[j] == HL_NORMAL) {
-          if (current_color != -1) {
-            abAppend(ab, "\x1b[39m", 5);
-            current_color = -1;
-          }
-          abAppend(ab, &c[j], 1);
+          abAppend(line, "\x1b[7m", 4);
+          abPutc(line, sym);
+          abAppend(line, "\x1b[m", 3);
+          if (cur->color != -1) abAppend(line, cur->esc, cur->len);
+          j++;
+          continue;
+        }
+        /* Copy the run of printable bytes that share a colour at once. */
+        const struct hlcolor *col = &colors[hl ? hl[j] : HL_NORMAL];
+        int k = j + 1;
+        if (hl) {
+          while (k < len && !iscntrl(c[k]) && colors[hl[k]].color == col->color)
+            k++;
         } else {
-          int color = editorSyntaxToColor(hl[j]);
-          if (current_color != color) {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            abAppend(ab, buf, clen);
-            current_color = color;
-          }
-          abAppend(ab, &c[j], 1);
+          while (k < len && !iscntrl(c[k])) k++;
         }
+        if (col->color != cur->color) {
+          abAppend(line, col->esc, col->len);
+          cur = col;
+        }
+        abAppend(line, &c[j], k - j);
+        j = k;
       }
-      abAppend(ab, "\x1b[39m", 5);
+      abAppend(line, "\x1b[39m", 5);
+      row = editorRowNext(row);
     }
 
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
+    abAppend(line, "\x1b[K", 3);
+    editorScreenLine(out, y, line);
   }
 }
 
-void editorDrawStatusBar(struct abuf *ab) {
+void editorDrawStatusBar(struct abuf *out, struct abuf *ab) {
+  ab->len = 0;
   abAppend(ab, "\x1b[7m", 4);
   char status[80], rstatus[80];
   
   int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
     E.filename ? E.filename : "[No Name]", E.numrows,
     E.dirty ? "(modified)" : "");
+  if (E.load.active && len < (int)sizeof(status))
+    len += snprintf(status + len, sizeof(status) - len, "%s(loading %d%%)",
+      E.dirty ? " " : "", (int)(E.load.seen * 100 / E.origlen));
+  if (len >= (int)sizeof(status)) len = sizeof(status) - 1;
 
   int rlen = snprintf(rstatus, sizeof(rstatus), "%s %d/%d",
     E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
@@ -974,43 +3253,72 @@ void editorDrawStatusBar(struct abuf *ab) {
       abAppend(ab, rstatus, rlen);
       break;
     } else {
-      abAppend(ab, " ", 1);
+      abPutc(ab, ' ');
       len++;
     }
   }
   abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2);
+  editorScreenLine(out, E.screenrows, ab);
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar(struct abuf *out, struct abuf *line) {
+  line->len = 0;
+  abAppend(line, "\x1b[K", 3);
   int msglen = strlen(E.statusmsg);
   if (msglen > E.screencols) msglen = E.screencols;
   if (msglen && time(NULL) - E.statusmsg_time < 5)
-    abAppend(ab, E.statusmsg, msglen);
+    abAppend(line, E.statusmsg, msglen);
+  editorScreenLine(out, E.screenrows + 1, line);
 }
 
 void editorRefreshScreen() {
   editorScroll();
+  editorHighlightPending();
+
+  static struct abuf ab = ABUF_INIT;
+  static struct abuf line = ABUF_INIT;
+  struct shadow *sh = &E.shadow;
+  if (sh->nlines != E.screenrows + 2) {
+    for (int y = 0; y < sh->nlines; y++) free(sh->lines[y].b);
+    sh->nlines = E.screenrows + 2;
+    sh->lines = realloc(sh->lines, sizeof(*sh->lines) * sh->nlines);
+    for (int y = 0; y < sh->nlines; y++) {
+      sh->lines[y].b = NULL;
+      sh->lines[y].len = -1;
+      sh->lines[y].cap = 0;
+    }
+    sh->cy = -1;
+    abGrow(&ab, sh->nlines * (E.screencols * 2 + 32));
+  }
 
-  struct abuf ab = ABUF_INIT;
-
+  clock_gettime(CLOCK_MONOTONIC, &sh->drawn);
+  ab.len = 0;
   abAppend(&ab, "\x1b[?25l", 6);
-  abAppend(&ab, "\x1b[H", 3);
 
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+  int shift = E.rowoff - sh->rowoff;
+  if (sh->cy != -1 && shift != 0 && abs(shift) < E.screenrows)
+    editorScreenScroll(&ab, shift);
+  sh->rowoff = E.rowoff;
 
+  editorDrawRows(&ab, &line);
+  editorDrawStatusBar(&ab, &line);
+  editorDrawMessageBar(&ab, &line);
+
+  int cy = (E.cy - E.rowoff) + 1;
+  int cx = (E.rx - E.coloff) + E.rowborder_width + 1;
+  if (ab.len == 6) {
+    ab.len = 0;
+    if (cy == sh->cy && cx == sh->cx) return;
+  }
   char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-                                            (E.rx - E.coloff) + E.rowborder_width + 1);
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cy, cx);
   abAppend(&ab, buf, strlen(buf));
+  sh->cy = cy;
+  sh->cx = cx;
 
-  abAppend(&ab, "\x1b[?25h", 6);
+  if (ab.len > (int)strlen(buf)) abAppend(&ab, "\x1b[?25h", 6);
 
   write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -1049,6 +3357,17 @@ char* editorPrompt(char *prompt, void (*callback)(char *, int)) {
         if (callback) callback(buf, c);
         return buf;
       }
+    } else if (c == PASTE) {
+      for (int i = 0; i < E.paste.len; i++) {
+        char p = E.paste.buf[i];
+        if (iscntrl(p)) continue;
+        if (buflen == bufsize - 1) {
+          bufsize *= 2;
+          buf = realloc(buf, bufsize);
+        }
+        buf[buflen++] = p;
+      }
+      buf[buflen] = '\0';
     } else if (!iscntrl(c) && c < 128) {
       if (buflen == bufsize - 1) {
         bufsize *= 2;
@@ -1062,7 +3381,7 @@ char* editorPrompt(char *prompt, void (*callback)(char *, int)) {
 }
 
 void editorMoveCursor(int key) {
-  erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  erow *row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
 
   switch (key) {
     case ARROW_LEFT:
@@ -1070,7 +3389,7 @@ void editorMoveCursor(int key) {
         E.cx--;
       } else if (E.cy > 0) {
         E.cy--;
-        E.cx = E.row[E.cy].size;
+        E.cx = editorRowAt(E.cy)->size;
       }
       break;
     case ARROW_RIGHT:
@@ -1084,22 +3403,23 @@ void editorMoveCursor(int key) {
     case ARROW_UP:
       if (E.cy != 0) {
         E.cy--;
-        E.cx = editorRowRxToCx(&E.row[E.cy], E.rx);
+        if (E.cy < E.numrows)
+          E.cx = editorRowRxToCx(editorRowAt(E.cy), E.rx);
       }
       break;
     case ARROW_DOWN:
       if (E.cy < E.numrows) {
         E.cy++;
         if (E.cy < E.numrows)
-          E.cx = editorRowRxToCx(&E.row[E.cy], E.rx);
+          E.cx = editorRowRxToCx(editorRowAt(E.cy), E.rx);
       }
       break;
     case CTRL_ARROW_LEFT:
       if (E.cx == 0) {
         editorMoveCursor(ARROW_LEFT);
       } else if (row) {
-        int isCurrAlnum = isalnum(row->chars[E.cx-1]) ? 1 : 0;
-        while(E.cx > 0 && (isalnum(row->chars[E.cx-1]) ? 1 : 0) == isCurrAlnum) {
+        int isCurrAlnum = isalnum(editorRowCharAt(row, E.cx-1)) ? 1 : 0;
+        while(E.cx > 0 && (isalnum(editorRowCharAt(row, E.cx-1)) ? 1 : 0) == isCurrAlnum) {
           E.cx--;
         }
       }
@@ -1109,8 +3429,8 @@ void editorMoveCursor(int key) {
         if (E.cx == row->size) {
           editorMoveCursor(ARROW_RIGHT);
         } else {
-          int isCurrAlnum = isalnum(row->chars[E.cx]) ? 1 : 0;
-          while(E.cx < row->size && (isalnum(row->chars[E.cx]) ? 1 : 0) == isCurrAlnum) {
+          int isCurrAlnum = isalnum(editorRowCharAt(row, E.cx)) ? 1 : 0;
+          while(E.cx < row->size && (isalnum(editorRowCharAt(row, E.cx)) ? 1 : 0) == isCurrAlnum) {
             E.cx++;
           }
         }
@@ -1118,7 +3438,7 @@ void editorMoveCursor(int key) {
       break;
   }
 
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
   int rowlen = row ? row->size : 0;
   if (E.cx > rowlen) {
     E.cx = rowlen;
@@ -1134,7 +3454,7 @@ void editorProcessKeypress(int c) {
       break;
     case CTRL_ENTER:
       if (E.cy < E.numrows)
-        E.cx = E.row[E.cy].size;
+        E.cx = editorRowAt(E.cy)->size;
       editorInsertNewLine();
       break;
     case CTRL_SHIFT_ENTER:
@@ -1150,8 +3470,13 @@ void editorProcessKeypress(int c) {
         quit_times--;
         return;
       }
+      editorSavePoll(1);
+      editorJournalClose();
       write(STDOUT_FILENO, "\x1b[2J", 4);
       write(STDOUT_FILENO, "\x1b[H", 3);
+      if (getenv("KILO_STATS"))
+        fprintf(stderr, "hl cache: %lu hits, %lu misses\n",
+          E.hlcache.hits, E.hlcache.misses);
       exit(0);
       break;
     case CTRL_KEY('s'):
@@ -1171,7 +3496,7 @@ void editorProcessKeypress(int c) {
 
     case END_KEY:
       if (E.cy < E.numrows)
-        E.cx = E.row[E.cy].size;
+        E.cx = editorRowAt(E.cy)->size;
       break;
 
     case BACKSPACE:
@@ -1218,10 +3543,11 @@ void editorProcessKeypress(int c) {
 
     case CTRL_DELETE:
       if (E.cy != E.numrows) {
-        if (E.cx == E.row[E.cy].size) {
+        erow *row = editorRowAt(E.cy);
+        if (E.cx == row->size) {
           editorProcessKeypress(DEL_KEY);
         } else {
-          editorInsertChar(isalnum(E.row[E.cy].chars[E.cx]) ? ' ' : 'a');
+          editorInsertChar(isalnum(editorRowCharAt(row, E.cx)) ? ' ' : 'a');
           editorMoveCursor(CTRL_ARROW_RIGHT);
           editorDelWord();
           editorDelChar();
@@ -1249,6 +3575,10 @@ void editorProcessKeypress(int c) {
       editorDuplicateLine();
       break;
 
+    case PASTE:
+      editorInsertBlock(E.paste.buf, E.paste.len);
+      break;
+
     case CTRL_KEY('l'):
     case '\x1b':
       break; 
@@ -1270,7 +3600,30 @@ void initEditor() {
   E.coloff = 0;
   E.numrows = 0;
   E.rowborder_width = 0;
-  E.row = NULL;
+  E.rows = NULL;
+  E.hot = NULL;
+  E.orig = NULL;
+  E.origlen = 0;
+  E.mapped = 0;
+  E.lines.off = NULL;
+  E.lines.n = E.lines.cap = 0;
+  E.loadlines = 0;
+  E.loadpos = 0;
+  E.load.active = 0;
+  E.save.active = 0;
+  pthread_mutex_init(&E.save.lock, NULL);
+  memset(&E.hlw, 0, sizeof(E.hlw));
+  memset(&E.hlcache, 0, sizeof(E.hlcache));
+  pthread_mutex_init(&E.hlcache.lock, NULL);
+  memset(&E.shadow, 0, sizeof(E.shadow));
+  pthread_mutex_init(&E.hlw.lock, NULL);
+  memset(&E.journal, 0, sizeof(E.journal));
+  E.journal.fd = -1;
+  pthread_mutex_init(&E.journal.lock, NULL);
+  pthread_cond_init(&E.journal.wake, NULL);
+  E.add.chunk = NULL;
+  E.add.len = 0;
+  E.add.cap = 0;
   E.dirty = 0;
   E.filename = NULL;
   E.statusmsg[0] = '\0';
@@ -1290,11 +3643,21 @@ int main(int argc, char *argv[]) {
 
   editorSetStatusMessage(
     "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+  if (E.filename) editorJournalOpen();
 
   while (1) {
     editorRefreshScreen();
     int c = editorReadKey();
     editorProcessKeypress(c);
+    /* Keys that are already waiting, as in a paste or under auto-repeat,
+     * are all applied before the next frame, and frames are spaced at
+     * least editorFrameWait() apart. Each key still sees the rx and
+     * rowoff a frame would have left it. */
+    while (editorInputWait(editorFrameWait())) {
+      editorScroll();
+      editorProcessKeypress(editorReadKey());
+    }
+    editorJournalFlush(0);
   }
 
   return 0;
@@ -0,0 +1,454 @@
+/*
+ * Regression tests for kilo. kilo.c is compiled in whole, with its main()
+ * renamed, and each test drives the editor's functions directly in a
+ * child process of its own with stdin and stdout on a pseudo-terminal.
+ * Built with AddressSanitizer by 'make test'.
+ */
+
+#define main kilo_main
+#include "kilo.c"
+#undef main
+
+#include <pty.h>
+#include <sys/wait.h>
+
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    exit(1); \
+  } \
+} while (0)
+
+pthread_mutex_t test_out_lock = PTHREAD_MUTEX_INITIALIZER;
+char *test_out;
+size_t test_outlen, test_outcap;
+int test_master;
+
+void *testDrain(void *arg) {
+  char buf[4096];
+  int fd = *(int *)arg;
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    pthread_mutex_lock(&test_out_lock);
+    if (test_outlen + n + 1 > test_outcap) {
+      while (test_outlen + n + 1 > test_outcap)
+        test_outcap = test_outcap ? test_outcap * 2 : 1 << 16;
+      test_out = realloc(test_out, test_outcap);
+    }
+    memcpy(test_out + test_outlen, buf, n);
+    test_outlen += n;
+    test_out[test_outlen] = '\0';
+    pthread_mutex_unlock(&test_out_lock);
+  }
+  return NULL;
+}
+
+/* Puts stdin and stdout on a fresh 24x80 pseudo-terminal whose output is
+ * collected in test_out, and initializes the editor on it. */
+void testTerminal() {
+  int slave;
+  struct winsize ws = {24, 80, 0, 0};
+  pthread_t tid;
+  if (openpty(&test_master, &slave, NULL, NULL, &ws) == -1) die("openpty");
+  dup2(slave, STDIN_FILENO);
+  dup2(slave, STDOUT_FILENO);
+  pthread_create(&tid, NULL, testDrain, &test_master);
+  initEditor();
+}
+
+/* Writes 'len' bytes of 's' to a new temporary file named after 'name'
+ * and returns its path. */
+char *testFile(const char *name, const char *s, size_t len) {
+  static char path[64];
+  snprintf(path, sizeof(path), "/tmp/kilo_test_%d_%s", (int)getpid(), name);
+  FILE *fp = fopen(path, "w");
+  if (!fp) die("fopen");
+  fwrite(s, 1, len, fp);
+  fclose(fp);
+  return path;
+}
+
+/* Waits until the terminal has stopped producing output and returns how
+ * much there has been. */
+size_t testOutputSettle() {
+  size_t len = (size_t)-1;
+  for (;;) {
+    usleep(50000);
+    pthread_mutex_lock(&test_out_lock);
+    size_t now = test_outlen;
+    pthread_mutex_unlock(&test_out_lock);
+    if (now == len) return len;
+    len = now;
+  }
+}
+
+/* Refreshes the screen and returns whether what it wrote to the terminal
+ * contains 's'. */
+int testFrameHas(const char *s) {
+  size_t from = testOutputSettle();
+  editorRefreshScreen();
+  testOutputSettle();
+  pthread_mutex_lock(&test_out_lock);
+  int found = memmem(test_out + from, test_outlen - from, s, strlen(s)) != NULL;
+  pthread_mutex_unlock(&test_out_lock);
+  return found;
+}
+
+/* Runs the highlight worker until no pass is pending. */
+void testHighlightAll() {
+  for (int i = 0; i < 1000 && (E.nhlstale || E.hlw.active); i++) {
+    editorHighlightPoll(0);
+    editorHighlightPoll(1);
+  }
+  CHECK(E.nhlstale == 0);
+}
+
+char *testRowText(int at) {
+  erow *row = editorRowAt(at);
+  static char buf[1 << 16];
+  int n = 0;
+  for (int k = 0; k < row->npieces; k++) {
+    memcpy(buf + n, row->pieces[k].s, row->pieces[k].len);
+    n += row->pieces[k].len;
+  }
+  buf[n] = '\0';
+  return buf;
+}
+
+/* Runs fn in a child on a freshly initialized editor with 'path' open
+ * and its journal replayed, and returns whether it succeeded. */
+int testReopen(const char *path, void (*fn)()) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    initEditor();
+    editorOpen((char *)path);
+    editorJournalOpen();
+    fn();
+    editorJournalFlush(1);
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/*** tests ***/
+
+/* Search highlighting gave a hot row an hl sized to its render, which the
+ * gap buffer then shifted as if it had the gap's capacity. */
+void testTypeAfterSearch() {
+  char line[2001];
+  memset(line, 'x', 2000);
+  line[2000] = '\n';
+  editorOpen(testFile("long.txt", line, sizeof(line)));
+  E.cx = editorRowAt(0)->size;
+  editorProcessKeypress('a');
+  editorFindCallback("a", 'a');
+  editorFindCallback("a", '\r');
+  for (int i = 0; i < 100; i++) editorProcessKeypress('b');
+  CHECK(editorRowAt(0)->size == 2101);
+  unlink(E.filename);
+}
+
+/* Reaching a line of a highlighted file loads that line alone. Its
+ * highlighting is corrected once the lines above it are loaded. */
+void testLoadOneRow() {
+  char text[3 + 1000 * 2 + 1];
+  int len = 0;
+  len += sprintf(text + len, "/*\n");
+  for (int i = 0; i < 1000; i++) len += sprintf(text + len, "x\n");
+  editorOpen(testFile("deep.c", text, len));
+  CHECK(E.syntax != NULL);
+
+  erow *row = editorRowAt(600);
+  CHECK(!row->run && rowPrev(row)->run);
+  editorRowFresh(row);
+  CHECK(rowPrev(row)->run);
+  CHECK(row->hl[0] == HL_NORMAL);
+
+  E.rowoff = 590;
+  for (int i = 0; i < 600; i++) editorRowFresh(editorRowAt(i));
+  CHECK(row->hl[0] == HL_MLCOMMENT);
+  unlink(E.filename);
+}
+
+void testTornEditA() {
+  editorInsertChar('a');
+}
+
+void testTornEditB() {
+  CHECK(!strcmp(testRowText(0), "axyz"));
+  E.cx = 0;
+  editorInsertChar('b');
+}
+
+void testTornCheck() {
+  CHECK(!strcmp(testRowText(0), "baxyz"));
+}
+
+void testFailedEdit() {
+  int fd = E.journal.fd;
+  E.journal.fd = open(E.journal.path, O_RDONLY);
+  CHECK(E.journal.fd != -1);
+  editorInsertChar('a');
+  editorJournalFlush(1);
+  CHECK(E.journal.len > 0);
+  CHECK(strstr(E.statusmsg, "journal") != NULL);
+  close(E.journal.fd);
+  E.journal.fd = fd;
+}
+
+void testFailedCheck() {
+  CHECK(!strcmp(testRowText(0), "axyz"));
+}
+
+/* Records a write to the journal failed on are written by a later flush. */
+void testJournalWriteFails() {
+  char *path = strdup(testFile("fail.txt", "xyz\n", 4));
+  CHECK(testReopen(path, testFailedEdit));
+  CHECK(testReopen(path, testFailedCheck));
+  char journal[80];
+  char *slash = strrchr(path, '/');
+  snprintf(journal, sizeof(journal), "%.*s.%s.kjournal",
+           (int)(slash - path + 1), path, slash + 1);
+  unlink(journal);
+  unlink(path);
+}
+
+/* Records written after a torn one must not be lost behind it. */
+void testJournalTorn() {
+  char *path = strdup(testFile("torn.txt", "xyz\n", 4));
+  char journal[80];
+  char *slash = strrchr(path, '/');
+  snprintf(journal, sizeof(journal), "%.*s.%s.kjournal",
+           (int)(slash - path + 1), path, slash + 1);
+
+  CHECK(testReopen(path, testTornEditA));
+  int fd = open(journal, O_WRONLY | O_APPEND);
+  CHECK(fd != -1);
+  char torn[5] = {J_INSERT_CHAR, 0, 0, 0, 0};
+  CHECK(write(fd, torn, sizeof(torn)) == sizeof(torn));
+  close(fd);
+  CHECK(testReopen(path, testTornEditB));
+  CHECK(testReopen(path, testTornCheck));
+  unlink(journal);
+  unlink(path);
+}
+
+/* A pass the worker has yet to bring down to the screen leaves the rows
+ * on it in the colours they had before the edit; they are drawn plain
+ * until it has. */
+void testPlainWhilePending() {
+  char text[300 * 7 + 1];
+  int len = 0;
+  for (int i = 0; i < 300; i++) len += sprintf(text + len, "int x;\n");
+  editorOpen(testFile("pending.c", text, len));
+  for (int i = 0; i < E.numrows; i++) editorRowAt(i);
+  editorSelectSyntaxHighlight();
+  testHighlightAll();
+  E.cy = E.rowoff = 150;
+  CHECK(testFrameHas("\x1b[36mint"));
+
+  E.cy = E.rowoff = E.cx = 0;
+  editorRefreshScreen();
+  editorInsertChar('/');
+  editorInsertChar('*');
+  E.cy = E.rowoff = 150;
+  CHECK(!testFrameHas("\x1b[36m"));
+  E.shadow.cy = -1;
+  for (int y = 0; y < E.shadow.nlines; y++) E.shadow.lines[y].len = -1;
+  CHECK(!testFrameHas("\x1b[35m"));
+  testHighlightAll();
+  CHECK(testFrameHas("\x1b[35mint"));
+  unlink(E.filename);
+}
+
+/* Returns the highlight classes of row 'at' as one digit per byte of its
+ * render. */
+char *testRowClasses(int at) {
+  erow *row = editorRowAt(at);
+  editorRowFresh(row);
+  static char buf[1 << 16];
+  for (int i = 0; i < row->rsize; i++) buf[i] = '0' + row->hl[i];
+  buf[row->rsize] = '\0';
+  return buf;
+}
+
+/* The lexer tables give each token of a C file the class the hand-written
+ * lexer they replaced gave it. */
+void testLexerClasses() {
+  const char text[] =
+      "int f(x) { return \"s\\\"\" + 12; } // c\n"
+      "/* a */ char y = 'q'; g(0x1f);\n"
+      "if1 = 1.5 /* b\n"
+      "c */ while (z)\n";
+  editorOpen(testFile("lex.c", text, sizeof(text) - 1));
+  CHECK(!strcmp(testRowClasses(0), "777080000006666660222220001100004444"));
+  CHECK(!strcmp(testRowClasses(1), "555555507777000002220080100000"));
+  CHECK(!strcmp(testRowClasses(2), "00000011105555"));
+  CHECK(!strcmp(testRowClasses(3), "55550666660000"));
+  unlink(E.filename);
+}
+
+/* The worker's passes look rows up in the highlight cache and fill it. */
+void testWorkerCache() {
+  char text[300 * 7 + 1];
+  int len = 0;
+  for (int i = 0; i < 300; i++) len += sprintf(text + len, "int x;\n");
+  editorOpen(testFile("cache.c", text, len));
+  for (int i = 0; i < E.numrows; i++) editorRowAt(i);
+  editorSelectSyntaxHighlight();
+  testHighlightAll();
+  CHECK(E.hlcache.hits >= 299);
+  CHECK(editorRowAt(299)->hl[0] == HL_KEYWORD2);
+  unlink(E.filename);
+}
+
+/* The last row of a paste takes the rest of the line it was pasted into,
+ * and keeps all of it once the worker has highlighted it. */
+void testPasteTail() {
+  editorOpen(testFile("paste.c", "xy\tz\n", 5));
+  E.cx = 1;
+  editorInsertBlock("1\n2\n3", 5);
+  editorSelectSyntaxHighlight();
+  testHighlightAll();
+  CHECK(!strcmp(testRowText(2), "3y\tz"));
+  erow *row = editorRowAt(2);
+  CHECK(row->rsize == 5 && !memcmp(row->render, "3y  z", 5));
+  unlink(E.filename);
+}
+
+/* Sends 's' to the editor as if typed, in raw mode, and reads one key. */
+int testType(const char *s) {
+  struct termios raw;
+  tcgetattr(STDIN_FILENO, &raw);
+  cfmakeraw(&raw);
+  tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+  CHECK(write(test_master, s, strlen(s)) == (ssize_t)strlen(s));
+  return editorReadKey();
+}
+
+/* A paste that closes a comment opened above it uncolours the rows below
+ * the pasted ones. */
+void testPasteClosesComment() {
+  editorOpen(testFile("close.c", "x /*\nint y;\n", 12));
+  for (int i = 0; i < E.numrows; i++) editorRowAt(i);
+  editorRowFresh(editorRowAt(1));
+  CHECK(editorRowAt(1)->hl[0] == HL_MLCOMMENT);
+  E.cx = 4;
+  editorInsertBlock("*/\nz", 4);
+  for (int i = 0; i < E.numrows; i++) editorRowFresh(editorRowAt(i));
+  editorHighlightPending();
+  testHighlightAll();
+  erow *row = editorRowAt(2);
+  CHECK(row->hl[0] == HL_KEYWORD2 && row->hl_open_comment == 0);
+  unlink(E.filename);
+}
+
+/* Rows drawn plain below more than a screen of unhighlighted ones are
+ * coloured in the end, even when the main thread highlights the row the
+ * pass was to start at first. The pass starts a screen above them. */
+void testPlainRowsColoured() {
+  char text[300 * 7 + 1];
+  int len = 0;
+  for (int i = 0; i < 300; i++) len += sprintf(text + len, "int x;\n");
+  editorOpen(testFile("q.c", "\n", 1));
+  editorInsertBlock(text, len);
+  E.cx = 0;
+  E.cy = E.rowoff = 250;
+  editorRefreshScreen();
+  CHECK(editorRowAt(250)->flags & ROW_HL_NONE);
+  CHECK(E.nhlstale == 1);
+  CHECK(editorRowIndex(E.hlstale[0]) == 250 - E.screenrows - 1);
+  E.cy = E.rowoff = 0;
+  editorRefreshScreen();
+  testHighlightAll();
+  erow *row = editorRowAt(250);
+  CHECK(!(row->flags & ROW_HL_NONE) && row->hl && row->hl[0] == HL_KEYWORD2);
+  unlink(E.filename);
+}
+
+/* Moving a row out of a comment recolours it, and a row moved without
+ * changing the state it starts in takes its hl from the cache. */
+void testMoveRow() {
+  const char text[] = "int a;\n/* x\nint b;\n*/\n";
+  editorOpen(testFile("move.c", text, sizeof(text) - 1));
+  for (int i = 0; i < E.numrows; i++) editorRowFresh(editorRowAt(i));
+  CHECK(editorRowAt(2)->hl[0] == HL_MLCOMMENT);
+  unsigned long hits = E.hlcache.hits;
+  E.cy = 2;
+  editorMoveLineUp();
+  CHECK(!strcmp(testRowText(1), "int b;"));
+  CHECK(editorRowAt(1)->hl[0] == HL_KEYWORD2);
+  CHECK(editorRowAt(2)->hl[0] == HL_MLCOMMENT);
+  CHECK(editorRowAt(3)->hl[0] == HL_MLCOMMENT);
+  CHECK(E.hlcache.hits > hits);
+  unlink(E.filename);
+}
+
+/* Ending a search recolours the row the match was shown on as it is
+ * now, not as it was when the search found it. */
+void testSearchRestore() {
+  const char text[] = "/*\nint a;\n";
+  editorOpen(testFile("find.c", text, sizeof(text) - 1));
+  for (int i = 0; i < E.numrows; i++) editorRowFresh(editorRowAt(i));
+  CHECK(editorRowAt(1)->hl[0] == HL_MLCOMMENT);
+  editorFindCallback("a", 'a');
+  CHECK(E.cy == 1 && editorRowAt(1)->hl[4] == HL_MATCH);
+  editorRowDelChar(editorRowAt(0), 0);
+  editorRowDelChar(editorRowAt(0), 0);
+  editorFindCallback("a", '\r');
+  erow *row = editorRowAt(1);
+  CHECK(row->hl[0] == HL_KEYWORD2 && row->hl[4] == HL_NORMAL);
+  unlink(E.filename);
+}
+
+/* A paste cut short before its end marker ends with what has arrived. */
+void testPasteCutShort() {
+  CHECK(testType("\x1b[200~ab\ncd") == PASTE);
+  CHECK(E.paste.len == 5 && !memcmp(E.paste.buf, "ab\ncd", 5));
+  CHECK(testType("\x1b[200~xy\x1b[20") == PASTE);
+  CHECK(E.paste.len == 2 && !memcmp(E.paste.buf, "xy", 2));
+  CHECK(testType("\x1b[200~z\x1b[201~q") == PASTE);
+  CHECK(E.paste.len == 1 && E.paste.buf[0] == 'z');
+  CHECK(editorReadKey() == 'q');
+}
+
+struct test {
+  const char *name;
+  void (*fn)();
+};
+
+struct test tests[] = {
+  {"type after search", testTypeAfterSearch},
+  {"load one row", testLoadOneRow},
+  {"journal with a torn record", testJournalTorn},
+  {"journal write that fails", testJournalWriteFails},
+  {"plain while a pass is pending", testPlainWhilePending},
+  {"lexer classes", testLexerClasses},
+  {"highlight cache on the worker", testWorkerCache},
+  {"paste into a line", testPasteTail},
+  {"paste cut short", testPasteCutShort},
+  {"paste that closes a comment", testPasteClosesComment},
+  {"plain rows coloured in the end", testPlainRowsColoured},
+  {"move a row out of a comment", testMoveRow},
+  {"search restores current colours", testSearchRestore},
+};
+
+int main() {
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      testTerminal();
+      tests[i].fn();
+      _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    int ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    fprintf(stderr, "%s: %s\n", ok ? "PASS" : "FAIL", tests[i].name);
+    failed += !ok;
+  }
+  return failed != 0;
+}